@@ -9,16 +9,101 @@
  * pointer next to the block header.
  *
  * Allocated blocks do not store such pointers and therefore the entire heap can
- * be traversed like an implicit list.
+ * be traversed like an implicit list. Allocated blocks do not have a footer
+ * either: every header records whether the previous block is allocated, so
+ * the footer of the previous block is only read when it is free.
  *
- * The placement policy is a variant of First Fit, in that the first block in a
- * suitable free list is popped and allocated for a new payload. However, when
- * we insert a new free block into a free list, we make sure to maintain an
- * ascending order in terms of block size. As a result, this placement policy is
- * also similar to Best Fit.
+ * The placement policy is a variant of First Fit, in that the first block big
+ * enough in a suitable free list, looking at no more than FIT_DEPTH of them, is
+ * popped and allocated for a new payload. However, when we insert a new free
+ * block into a free list, we make sure to maintain an ascending order in terms
+ * of block size. As a result, this placement policy is also similar to Best Fit.
+ *
+ * There is a free list for every size class, and there are CLASS_STEPS classes
+ * per power of two (32, 40, 48, 56, 64, 80, ... bytes on 64-bit), so that the
+ * blocks in a list differ by at most a quarter in size. The class of a small
+ * size is looked up in a table made by mm_init. When built with ROUND_CLASSES
+ * defined, small blocks are also rounded up to the size of their class.
+ *
+ * The free lists of large blocks can grow long, so from TREE_LIST on, each of
+ * them is also kept as a treap ordered by block size and address. Inserting a
+ * block looks up its place in the list in the treap rather than walking the
+ * list, and a fit is the smallest big enough block in the treap, so both take
+ * O(log n). The lists stay sorted, and are still what the rest walks.
+ *
+ * When built with ADDR_ORDER defined, the free lists are ordered by address
+ * instead, and a fit is the first block big enough in the list of its class,
+ * or else the first block of the next non-empty list; placing blocks at low
+ * addresses keeps fragmentation lower over a long run. Every list whose blocks
+ * can hold a treap node is then kept as a treap ordered by address, so that
+ * inserting stays O(log n); the lists below hold blocks too small for one,
+ * and are walked to keep their order, as the size-ordered ones are. The fast
+ * bins are LIFO and come before all of this, so most small requests are
+ * served regardless of address, unless FAST_BINS is set to 0.
  *
  * Coalescing is performed everytime the heap is extended or a block is freed.
+ * A freed and coalesced block is not sorted into its list right away, but
+ * pushed onto an unsorted bin. The next malloc takes blocks off the bin and
+ * sorts them into their lists, unless one of them fits the request without a
+ * remainder, which it takes at once; so a block freed and allocated again
+ * soon after never gets sorted.
+ *
+ * Small blocks of up to FAST_MAX bytes skip even that: a freed small block
+ * stays marked as allocated and is pushed onto a fast bin of its exact size,
+ * and a malloc of that size pops it again, without coalescing or splitting.
+ * The fast bins are merged back into the heap, coalescing their blocks, before
+ * a request of FAST_FLUSH bytes or more, and before the heap would grow.
+ *
+ * A bitmap of the non-empty free lists is kept in the word right before the
+ * free list pointers, so that a suitable list can be found with a single
+ * count-trailing-zeros instead of probing every list.
+ *
+ * Alternatively, when built with TLSF defined, the free lists are organized as
+ * a Two-Level Segregated Fit: the first level splits sizes by powers of two,
+ * the second level splits every power of two linearly into SL_COUNT lists.
+ * Both levels have bitmaps and the lists are unordered, so finding a fit and
+ * inserting a free block are both O(1). Boundary tags, coalescing and
+ * splitting are shared with the default segregated fits.
+ *
+ * When built with THREADS defined, the heap is split into ARENAS arenas, each
+ * with its own free lists, prologue/epilogue and lock. Threads are assigned to
+ * arenas round-robin, and move on to the next arena when theirs is contended.
+ * Every header records the arena of its block, so a block is always freed
+ * into the arena it came from. A block freed by a thread of another arena is
+ * pushed onto a lock-free queue of its arena instead, which the owner drains
+ * the next time it locks the arena. As arenas share the break, an arena that grows
+ * after another one starts a new segment, with its own prologue and epilogue.
+ * On top of that, every thread keeps a cache of recently freed small blocks
+ * per block size. Cached blocks stay marked as allocated in the heap, so
+ * mm_malloc and mm_free only take a lock when a cache bin runs dry or
+ * overflows, and then move blocks between the cache and the heap in batches.
+ *
+ * When built with PURGE defined, large free blocks that stay free for a while
+ * give their pages back to the operating system: the page-aligned interior of
+ * such a block is madvise'd away, and faulted back in as zero pages once it is
+ * allocated again, so mm_calloc need not clear them. How long a block has been
+ * free is measured in the mallocs and frees that reach the heap.
+ *
+ * When built with HUGE defined, blocks of at least HUGE_MIN bytes are not
+ * taken from the heap, but get an anonymous mapping of their own, which is
+ * unmapped as soon as they are freed and resized with mremap.
+ *
+ * The heap is a list of segments, each with its own prologue and epilogue.
+ * A chunk extending the heap joins the newest segment if it starts right after
+ * its epilogue, and starts a new segment otherwise. When built with MMAP
+ * defined, chunks are mapped rather than taken from mem_sbrk, and a segment
+ * that holds nothing but a free block is unmapped, unless it is the newest.
+ *
+ * When built with SLAB defined, requests of up to SLAB_MAX bytes do not get
+ * a block at all, but a slot in a slab: a page-sized run of equal slots of
+ * one size class, outside of the heap, with a bitmap of its free slots in
+ * the run header. Slots have no header of their own, the run of a slot is
+ * found by rounding its address down to the page, and whether a pointer is
+ * a slot at all by whether it lies in the address space reserved for slabs.
+ * Once all of that is used, tiny requests get blocks from the heap again. As
+ * a slot cannot record an arena, slabs cannot be combined with THREADS.
  */
+#define _GNU_SOURCE        // for mremap
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -45,10 +130,38 @@ team_t team = {
     ""
 };
 
+/*
+ * Every option below, and every tunable after the basic macros, can also be
+ * set on the command line (e.g. -DADDR_ORDER -DFIT_DEPTH=16) to build a
+ * variant without editing this file; they are all compile-time constants,
+ * and combinations that cannot work are rejected with an #error
+ */
 /* uncomment the following line when debugging using mm_check */
 //#define DEBUG      TRUE
 /* uncomment the following line when debugging in verbose mode */
 //#define VERBOSE    TRUE
+/* uncomment the following line to use the two-level segregated fit lists */
+//#define TLSF       TRUE
+/* uncomment the following line to make the allocator thread-safe */
+//#define THREADS    TRUE
+/* uncomment the following line to give the pages of large free blocks back */
+//#define PURGE      TRUE
+/* uncomment the following line to map huge blocks outside of the heap */
+//#define HUGE       TRUE
+/* uncomment the following line to map heap segments instead of using mem_sbrk */
+//#define MMAP       TRUE
+/* uncomment the following line to place blocks with a fixed THRESHOLD */
+//#define PIN_THRESHOLD TRUE
+/* uncomment the following line to serve tiny blocks from slabs of equal slots */
+//#define SLAB       TRUE
+/* uncomment the following line to round small blocks up to their size class */
+//#define ROUND_CLASSES TRUE
+/* uncomment the following line to order free lists by address, not by size */
+//#define ADDR_ORDER TRUE
+
+#if defined(PURGE) || defined(HUGE) || defined(MMAP) || defined(SLAB)
+#include <sys/mman.h>
+#endif
 
 /* Basic macros, reference: CSAPP 9.9 p857 */
 #define ALIGNMENT  __SIZEOF_POINTER__
@@ -56,25 +169,267 @@ team_t team = {
 
 #define WSIZE      __SIZEOF_POINTER__       // word, size of header/footer
 #define DSIZE      2*WSIZE                  // double word
-#define CHUNKSIZE ((1<<12) + DSIZE)  // extend heap by how many bytes
+#define MAPBITS    (8 * WSIZE)              // bits in a bitmap word
+#define PAGESIZE  (1<<12)  // granularity of mmap and madvise
+
+// log2(4*WSIZE), the size of the first free list, as a compile-time constant
+#if __SIZEOF_POINTER__ == 8
+#define LOG_4WSIZE 5
+#else
+#define LOG_4WSIZE 4
+#endif
+
+/* Tunables */
+#ifndef CHUNKSIZE
+#define CHUNKSIZE ((1<<12) + DSIZE)  // extend heap by at least how many bytes
+#endif
+#ifndef CHUNKMAX
+#define CHUNKMAX  (1<<16)  // at most how many, set to CHUNKSIZE for a fixed step
+#endif
+#ifndef CHUNK_DECAY
+#define CHUNK_DECAY 256    // mallocs without extension that halve the step
+#endif
+#ifndef INITSIZE
 #define INITSIZE  ((1<<7) + DSIZE)   // initialize how many bytes
-#define LISTSIZE   16      // how many free lists we want
+#endif
+#ifndef THRESHOLD
 #define THRESHOLD  7       // threshold tuned for placement policy
+#endif
+#ifndef PIN_THRESHOLD
+#ifndef TUNE_CLASSES
+#define TUNE_CLASSES 8     // size classes the threshold is tuned for separately
+#endif
+#ifndef TUNE_EPOCH
+#define TUNE_EPOCH   64    // mallocs of a class between two adjustments
+#endif
+#ifndef TUNE_MAX
+#define TUNE_MAX     16    // the threshold is tuned between 1 and TUNE_MAX
+#endif
+#if THRESHOLD < 1 || THRESHOLD > TUNE_MAX
+#error "THRESHOLD is not between 1 and TUNE_MAX"
+#endif
+#endif
+#ifndef FAST_BINS
+#define FAST_BINS  32      // fast bins, one per block size from 4 words
+#endif
+#if FAST_BINS > MAPBITS
+#error "FAST_BINS do not fit in the bitmap of the fast bins"
+#endif
+#define FAST_MAX   (4*WSIZE + (FAST_BINS-1)*ALIGNMENT)  // biggest fast block
+#ifndef FAST_FLUSH
+#define FAST_FLUSH (1<<10) // requests this big merge the fast bins back first
+#endif
+#ifndef GROWMAX
+#define GROWMAX   (1<<20)  // most a block growing at the end extends the heap by
+#endif
+
+#ifdef TLSF
+#ifndef SL_LOG2
+#define SL_LOG2    3                      // log2 of second-level lists per class
+#endif
+#define SL_COUNT   (1 << SL_LOG2)
+#ifndef FL_COUNT
+#define FL_COUNT   16                     // first-level (power of two) classes
+#endif
+#define LISTSIZE   (FL_COUNT * SL_COUNT)  // how many free lists we want
+#define MAPSIZE    (FL_COUNT + 1)         // first-level map + second-level maps
+#if SL_COUNT > MAPBITS || FL_COUNT > MAPBITS
+#error "TLSF classes do not fit in the bitmaps"
+#endif
+#if SL_LOG2 > LOG_4WSIZE
+#error "SL_LOG2 splits the first power of two into steps below a byte"
+#endif
+#else
+#ifndef CLASS_LOG2
+#define CLASS_LOG2 2                         // log2 of size classes per power of two
+#endif
+#define CLASS_STEPS (1 << CLASS_LOG2)
+// the size of the i-th class, also usable in #if
+#define CLASS_SIZE(i) (((CLASS_STEPS + (i) % CLASS_STEPS) * (4*WSIZE / CLASS_STEPS)) \
+                       << ((i) / CLASS_STEPS))
+#ifndef LISTSIZE
+#if 16 * CLASS_STEPS < MAPBITS
+#define LISTSIZE   (16 * CLASS_STEPS)        // free lists, 16 powers of two from 4 words
+#else
+#define LISTSIZE   MAPBITS                   // free lists, one per bit of the map
+#endif
+#endif
+#define MAPSIZE    1       // words of bitmaps of non-empty free lists
+#ifndef TREE_LIST
+#ifndef ADDR_ORDER
+#define TREE_LIST  (4 * CLASS_STEPS)         // first free list that is also a treap
+#else
+// the first list above the class of 6 words, whose blocks hold a treap node
+#define TREE_LIST  (CLASS_STEPS == 1 ? 2 : CLASS_STEPS / 2 + 1)
+#endif
+#endif
+#ifndef FIT_DEPTH
+#define FIT_DEPTH  8       // blocks of its own list a request looks at for a fit
+#endif
+#ifndef CLASS_LOOKUP
+#define CLASS_LOOKUP (1<<10)  // sizes up to which the class is looked up in a table
+#endif
+#if CLASS_STEPS > 4 * WSIZE / ALIGNMENT
+#error "CLASS_STEPS split the first power of two into steps below ALIGNMENT"
+#endif
+// a treap node needs 7 words, so the class below TREE_LIST must be 6 or more
+#if TREE_LIST < 1
+#error "TREE_LIST is a class whose blocks cannot hold a treap node"
+#elif CLASS_SIZE(TREE_LIST - 1) < 6 * WSIZE
+#error "TREE_LIST is a class whose blocks cannot hold a treap node"
+#endif
+#if LISTSIZE > MAPBITS
+#error "LISTSIZE free lists do not fit in the bitmap of the free lists"
+#endif
+#if TREE_LIST > LISTSIZE
+#error "TREE_LIST is beyond the last free list"
+#endif
+#if (LISTSIZE - 1) / CLASS_STEPS + LOG_4WSIZE >= 8 * WSIZE - 1
+#error "LISTSIZE free lists have classes too big for a size_t"
+#endif
+#if CLASS_SIZE(LISTSIZE - 2) < CLASS_LOOKUP
+#error "LISTSIZE free lists end below CLASS_LOOKUP, the sizes of class_table"
+#endif
+#endif
+
+#if defined(TLSF) && defined(ADDR_ORDER)
+#error "TLSF lists are unordered, ADDR_ORDER only applies to the default lists"
+#endif
+
+#ifdef THREADS
+#ifndef ARENAS
+#define ARENAS       4     // how many arenas the heap is split into
+#endif
+#ifndef ARENA_BITS
+#define ARENA_BITS   4     // header bits holding the arena of a block
+#endif
+#if ARENA_BITS < 1 || ARENA_BITS > WSIZE
+#error "ARENA_BITS is not between 1 and WSIZE, which leaves the size its bits"
+#endif
+#if ARENAS > (1 << ARENA_BITS)
+#error "ARENAS do not fit in ARENA_BITS"
+#endif
+#ifndef REMOTE_MAX
+#define REMOTE_MAX   256   // queued remote frees after which the freer drains them
+#endif
+#ifndef TCACHE_BINS
+#define TCACHE_BINS  64    // thread cache bins, one per block size from 4 words
+#endif
+#ifndef TCACHE_COUNT
+#define TCACHE_COUNT 32    // how many blocks a thread cache bin holds at most
+#endif
+#ifndef TCACHE_FILL
+#define TCACHE_FILL  8     // how many blocks an empty bin gets from the heap
+#endif
+#if TCACHE_FILL > TCACHE_COUNT
+#error "TCACHE_FILL blocks do not fit in a bin of TCACHE_COUNT"
+#endif
+#endif
+
+#ifdef PURGE
+#ifndef PURGE_MIN
+#define PURGE_MIN    (1<<16)  // smallest free block whose pages are given back
+#endif
+#ifndef PURGE_DECAY
+#define PURGE_DECAY  1024     // heap operations a large block stays free unpurged
+#endif
+#endif
+
+#ifdef HUGE
+#ifndef HUGE_MIN
+#define HUGE_MIN     (1<<20)  // smallest block that gets a mapping of its own
+#endif
+#endif
+
+#ifdef SLAB
+#ifndef SLAB_MAX
+#define SLAB_MAX     128                     // biggest request served from a slab
+#endif
+#ifndef SLAB_SPAN
+#define SLAB_SPAN    (1UL<<28)               // address space reserved for slabs
+#endif
+#define SLAB_CLASSES (SLAB_MAX / ALIGNMENT)  // slot sizes, multiples of ALIGNMENT
+#define RUN_MAPS     (PAGESIZE / ALIGNMENT / MAPBITS)  // bitmap words of a run
+#if SLAB_MAX % ALIGNMENT != 0 || SLAB_MAX > PAGESIZE / 8
+#error "SLAB_MAX is not aligned, or too big for a run to hold enough slots"
+#endif
+// a slot has no header to record its arena in, so it could neither go to a
+// thread cache nor be queued as a remote free, and every tiny malloc and free
+// would take an arena lock, which is what THREADS exists to avoid
+#ifdef THREADS
+#error "SLAB cannot be combined with THREADS"
+#endif
+#endif
+
+#ifdef MMAP
+#ifndef SEGSIZE
+#define SEGSIZE      (1<<16)  // smallest mapping the heap grows by
+#endif
+#ifndef SEGMAX
+#define SEGMAX       (1<<24)  // new segments double in size up to this size
+#endif
+#endif
 
 #define MAX(x, y) ((x) > (y)? (x) : (y))
+#define MIN(x, y) ((x) < (y)? (x) : (y))
 
 // pack size and allocation bit into header/footer
+// with THREADS, the top ARENA_BITS of a header hold the arena of the block,
+// which is the arena this thread has currently locked
+#ifdef THREADS
+#define ARENA_SHIFT (8 * WSIZE - ARENA_BITS)
+#define PACK(size, alloc) ((size) | (alloc) | arena_tag)
+#else
 #define PACK(size, alloc) ((size) | (alloc))
+#endif
+
+// the second lowest bit of a header is set if the previous block is allocated
+#define PREV_ALLOC 0x2
+// the third lowest bit of a header is set if the block is a mapping of its own
+#define MAPPED     0x4
+// the same bit in the header of a free block is set if it is in the unsorted bin
+#define UNSORTED   0x4
 
 // read and write a word at address p
 #define GET(p) (*(unsigned long *)(p))
 #define PUT(p, val) (*(unsigned long *)(p) = (unsigned long)(val))
 
+// read the header of an allocated block without the lock
+// with THREADS, the owner of its arena may set or clear its prev-allocated bit
+// meanwhile, so both sides go through atomics, and only the other bits, which
+// do not change while the block is allocated, are relied upon
+#ifdef THREADS
+#define LOAD(p) __atomic_load_n((unsigned long *)(p), __ATOMIC_RELAXED)
+#else
+#define LOAD(p) GET(p)
+#endif
+
 // read the size and allocated bit from address p
+#ifdef THREADS
+#define GET_SIZE(p) (GET(p) & ~0x7 & ((1UL << ARENA_SHIFT) - 1))
+#define LOAD_SIZE(p) (LOAD(p) & ~0x7 & ((1UL << ARENA_SHIFT) - 1))
+#define GET_ARENA(p) (LOAD(p) >> ARENA_SHIFT)
+#else
 #define GET_SIZE(p) (GET(p) & ~0x7)
+#define LOAD_SIZE(p) (LOAD(p) & ~0x7)
+#endif
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+#define GET_MAPPED(p) (LOAD(p) & MAPPED)
+
+// set or clear the prev-allocated bit in the header of block bp
+#ifdef THREADS
+#define SET_PREV_ALLOC(bp) \
+    __atomic_fetch_or((unsigned long *)HDRP(bp), PREV_ALLOC, __ATOMIC_RELAXED)
+#define CLR_PREV_ALLOC(bp) \
+    __atomic_fetch_and((unsigned long *)HDRP(bp), ~PREV_ALLOC, __ATOMIC_RELAXED)
+#else
+#define SET_PREV_ALLOC(bp) PUT(HDRP(bp), GET(HDRP(bp)) | PREV_ALLOC)
+#define CLR_PREV_ALLOC(bp) PUT(HDRP(bp), GET(HDRP(bp)) & ~PREV_ALLOC)
+#endif
 
 // given block ptr bp, compute address of its header and footer
+// (only free blocks and the prologue have a footer)
 #define HDRP(bp) ((char *)(bp) - WSIZE)
 #define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 
@@ -87,10 +442,42 @@ team_t team = {
 #define PRED_BLKP(bp) (*(char **)(bp))              // address of predecessor blk
 #define SUCC_BLKP(bp) (*(char **)((char *)(bp) + WSIZE)) // addr of successor blk
 
+// free blocks in a treap have their children three and four words after the
+// header (after the word that PURGE keeps the time a block was freed in)
+#define TREE_LEFT(bp)  (*(char **)((char *)(bp) + 3*WSIZE))
+#define TREE_RIGHT(bp) (*(char **)((char *)(bp) + 4*WSIZE))
+
 
 /* Global variable */
+#ifndef THREADS
 static char * heap_ptr; // points to the prologue block of the heap
 
+#else
+#include <pthread.h>
+static __thread char * heap_ptr; // prologue block of the arena this thread locked
+static __thread unsigned long arena_tag;    // index of that arena, for PACK
+static __thread unsigned long my_arena;     // arena this thread allocates from
+static __thread unsigned long arena_epoch;  // the heap my_arena was assigned in
+static char ** arenas;                      // arena table, at start of the heap
+static unsigned long next_arena;            // round-robin arena assignment
+#ifndef MMAP
+static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER; // arenas share it
+#endif
+static pthread_key_t  tcache_key;                    // flushes a cache at exit
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static unsigned long  heap_epoch;                    // bumped by every mm_init
+static __thread char * tcache;              // this thread's cache, in the heap
+static __thread unsigned long tcache_epoch; // the heap tcache was created in
+#endif
+#ifndef TLSF
+static unsigned char * class_table;  // size class of every size up to CLASS_LOOKUP
+#endif
+#ifdef SLAB
+static char * slab_base;     // address space reserved for the runs of slabs
+static char * slab_top;      // runs below it have been used
+static char * slab_spare;    // empty runs, linked through their first word
+#endif
+
 
 // we store pointers to free lists before the prologue block
 // we can quickly get the address of any of the pointers
@@ -98,16 +485,361 @@ static inline char * freelists(int index) {
     return heap_ptr - (LISTSIZE + 1 - index) * WSIZE;
 }
 
+// the words before the free list pointers hold bitmaps of non-empty lists,
+// by default a single map in which bit i is set iff the i-th list is not empty
+// for TLSF, map 0 has bit fl set iff any list of class fl is not empty, and
+// map 1 + fl has bit sl set iff the list fl * SL_COUNT + sl is not empty
+static inline char * listmap(int index) {
+    return heap_ptr - (LISTSIZE + MAPSIZE + 1 - index) * WSIZE;
+}
+
+// set or clear the bit(s) of the index-th free list
+static inline void mark_list(int index) {
+#ifdef TLSF
+    PUT(listmap(0), GET(listmap(0)) | (1UL << (index / SL_COUNT)));
+    PUT(listmap(1 + index / SL_COUNT),
+        GET(listmap(1 + index / SL_COUNT)) | (1UL << (index % SL_COUNT)));
+#else
+    PUT(listmap(0), GET(listmap(0)) | (1UL << index));
+#endif
+}
+
+static inline void unmark_list(int index) {
+#ifdef TLSF
+    PUT(listmap(1 + index / SL_COUNT),
+        GET(listmap(1 + index / SL_COUNT)) & ~(1UL << (index % SL_COUNT)));
+    if (GET(listmap(1 + index / SL_COUNT)) == 0)
+        PUT(listmap(0), GET(listmap(0)) & ~(1UL << (index / SL_COUNT)));
+#else
+    PUT(listmap(0), GET(listmap(0)) & ~(1UL << index));
+#endif
+}
+
+// a heap is a list of segments, each with a prologue and an epilogue; before
+// its bitmaps, a heap keeps the prologue of its newest segment and the address
+// right after its newest epilogue, where the heap grows without a new segment,
+// as well as the step it grows by and how many mallocs it served since
+#define HEAP_WORDS 4
+
+static inline char * heap_end(void) {
+    return heap_ptr - (LISTSIZE + MAPSIZE + 2) * WSIZE;
+}
+
+static inline char * heap_seg(void) {
+    return heap_ptr - (LISTSIZE + MAPSIZE + 3) * WSIZE;
+}
+
+static inline char * heap_step(void) {
+    return heap_ptr - (LISTSIZE + MAPSIZE + 4) * WSIZE;
+}
+
+static inline char * heap_quiet(void) {
+    return heap_ptr - (LISTSIZE + MAPSIZE + 5) * WSIZE;
+}
+
+// the footer of a segment's prologue links to the previous segment's prologue
+static inline char * last_segment(void) {
+    return *(char **)heap_seg();
+}
+
+static inline char * prev_segment(char * seg) {
+    return *(char **)seg;
+}
+
+#ifdef THREADS
+// before its heap words, every arena keeps its lock, and the head and length
+// of its queue of remote frees
+#define ARENA_WORDS (2 + (sizeof(pthread_mutex_t) + WSIZE - 1) / WSIZE)
+
+static inline char ** arena_remote(char * arena) {
+    return (char **)(arena - (LISTSIZE + MAPSIZE + HEAP_WORDS + 2) * WSIZE);
+}
+
+static inline long * arena_queued(char * arena) {
+    return (long *)(arena - (LISTSIZE + MAPSIZE + HEAP_WORDS + 3) * WSIZE);
+}
+
+static inline pthread_mutex_t * arena_lock(char * arena) {
+    return (pthread_mutex_t *)(arena - (LISTSIZE + MAPSIZE + HEAP_WORDS + 1 + ARENA_WORDS) * WSIZE);
+}
+
+static void drain_remote(void);
+
+// lock the arena this thread allocates from and make it the current one
+// a contended arena is not waited for, the thread moves on to the next one
+static void lock_arena(void)
+{
+    if (arena_epoch != heap_epoch) {
+        my_arena = __sync_fetch_and_add(&next_arena, 1) % ARENAS;
+        arena_epoch = heap_epoch;
+    }
+    if (pthread_mutex_trylock(arena_lock(arenas[my_arena])) != 0) {
+        my_arena = (my_arena + 1) % ARENAS;
+        pthread_mutex_lock(arena_lock(arenas[my_arena]));
+    }
+    heap_ptr  = arenas[my_arena];
+    arena_tag = my_arena << ARENA_SHIFT;
+    if (__atomic_load_n(arena_remote(heap_ptr), __ATOMIC_RELAXED) != NULL)
+        drain_remote();
+}
+
+// lock the arena block bp belongs to and make it the current one
+static void lock_owner(void * bp)
+{
+    unsigned long index = GET_ARENA(HDRP(bp));
+    pthread_mutex_lock(arena_lock(arenas[index]));
+    heap_ptr  = arenas[index];
+    arena_tag = index << ARENA_SHIFT;
+    if (__atomic_load_n(arena_remote(heap_ptr), __ATOMIC_RELAXED) != NULL)
+        drain_remote();
+}
+
+#define LOCK_HEAP()     lock_arena()
+#define LOCK_OWNER(bp)  lock_owner(bp)
+#define UNLOCK_HEAP()   pthread_mutex_unlock(arena_lock(heap_ptr))
+#define LOCK_SBRK()     pthread_mutex_lock(&sbrk_lock)
+#define UNLOCK_SBRK()   pthread_mutex_unlock(&sbrk_lock)
+
+// a thread cache is an allocated block in the heap holding the heads and
+// lengths of TCACHE_BINS lists of cached blocks; cached blocks stay marked
+// as allocated, and are linked through the first word of their payload
+static inline char * tcache_bin(int index) {
+    return tcache + index * WSIZE;
+}
+
+static inline char * tcache_len(int index) {
+    return tcache + (TCACHE_BINS + index) * WSIZE;
+}
+
+#else
+#define ARENA_WORDS 0
+
+#define LOCK_HEAP()
+#define LOCK_OWNER(bp)
+#define UNLOCK_HEAP()
+#define LOCK_SBRK()
+#define UNLOCK_SBRK()
+#endif
+
+#ifdef PURGE
+// before its arena words (if any), a heap keeps a clock counting the mallocs
+// and frees that reach it, and the time the oldest large free block not purged
+// yet was freed, 0 if there is none; a large free block keeps the time it was
+// freed in the word after its successor pointer, 0 once its pages are purged
+// (or, with MMAP, if they are fresh from a mapping, and so zero just the same)
+// it also keeps the range of pages that place last found zero, for mm_calloc
+#define PURGE_WORDS 4
+
+static inline char * purge_clock(void) {
+    return heap_ptr - (LISTSIZE + MAPSIZE + HEAP_WORDS + ARENA_WORDS + 2) * WSIZE;
+}
+
+static inline char * purge_oldest(void) {
+    return heap_ptr - (LISTSIZE + MAPSIZE + HEAP_WORDS + ARENA_WORDS + 3) * WSIZE;
+}
+
+static inline char * zero_start(void) {
+    return heap_ptr - (LISTSIZE + MAPSIZE + HEAP_WORDS + ARENA_WORDS + 4) * WSIZE;
+}
+
+static inline char * zero_end(void) {
+    return heap_ptr - (LISTSIZE + MAPSIZE + HEAP_WORDS + ARENA_WORDS + 5) * WSIZE;
+}
+
+#define FREED_AT(bp) ((char *)(bp) + DSIZE)
+
+// every malloc and free that reaches the heap advances its clock, and once the
+// oldest large free block has been free for long enough, old blocks are purged
+#define PURGE_TICK() do {                                               \
+        PUT(purge_clock(), GET(purge_clock()) + 1);                     \
+        if (GET(purge_oldest()) != 0 &&                                 \
+            GET(purge_clock()) - GET(purge_oldest()) >= PURGE_DECAY)    \
+            purge();                                                    \
+    } while (0)
+
+// a large block is freed now, and its pages are dirty until purged
+#define PURGE_STAMP(bp, size) do {                                      \
+        if ((size) >= PURGE_MIN) {                                      \
+            PUT(FREED_AT(bp), GET(purge_clock()));                      \
+            if (GET(purge_oldest()) == 0)                               \
+                PUT(purge_oldest(), GET(purge_clock()));                \
+        }                                                               \
+    } while (0)
+#else
+#define PURGE_WORDS 0
+#define PURGE_TICK()
+#define PURGE_STAMP(bp, size)
+#endif
+
+#ifndef PIN_THRESHOLD
+// before its purge words (if any), a heap keeps for every tuned size class
+// the threshold of place, whether it was last lowered, the share of mallocs
+// that found no fit before (in 1/1024), and the mallocs and misses since
+#define TUNE_FIELDS     5
+#define TUNE_WORDS      (TUNE_CLASSES * TUNE_FIELDS)
+#define TUNE_THRESHOLD  0
+#define TUNE_LOWERED    1
+#define TUNE_SCORE      2
+#define TUNE_MALLOCS    3
+#define TUNE_MISSES     4
+
+static inline char * tune_word(int cls, int field) {
+    return heap_ptr - (LISTSIZE + MAPSIZE + HEAP_WORDS + ARENA_WORDS + PURGE_WORDS
+                       + 2 + cls * TUNE_FIELDS + field) * WSIZE;
+}
+
+// the size classes are powers of two from 4 words, the last one is unbounded
+static inline int tune_class(size_t size) {
+    int cls = 8 * sizeof(unsigned long) - 1 - __builtin_clzl(size) - LOG_4WSIZE;
+    return cls < TUNE_CLASSES - 1 ? cls : TUNE_CLASSES - 1;
+}
+
+#define THRESHOLD_OF(size) GET(tune_word(tune_class(size), TUNE_THRESHOLD))
+#else
+#define TUNE_WORDS 0
+#define THRESHOLD_OF(size) THRESHOLD
+#endif
+
+#ifndef TLSF
+// before its tune words (if any), a heap keeps the root of the treap of every
+// free list from TREE_LIST on
+#define TREE_WORDS (LISTSIZE - TREE_LIST)
+
+static inline char * tree_root(int index) {
+    return heap_ptr - (LISTSIZE + MAPSIZE + HEAP_WORDS + ARENA_WORDS + PURGE_WORDS
+                       + TUNE_WORDS + 2 + index - TREE_LIST) * WSIZE;
+}
+
+// the priority of a block in a treap is a hash of its address
+#define TREE_PRIO(bp) ((uintptr_t)(bp) * (uintptr_t)0x9e3779b97f4a7c15ULL)
+#else
+#define TREE_WORDS 0
+#endif
+
+// before its treap roots (if any), a heap keeps the head of its unsorted bin
+#define BIN_WORDS 1
+
+static inline char * unsorted_bin(void) {
+    return heap_ptr - (LISTSIZE + MAPSIZE + HEAP_WORDS + ARENA_WORDS + PURGE_WORDS
+                       + TUNE_WORDS + TREE_WORDS + 2) * WSIZE;
+}
+
+// before its unsorted bin, a heap keeps a bitmap of its non-empty fast bins,
+// in which bit i is set iff the i-th fast bin is not empty, and their heads;
+// blocks in a fast bin are linked through the first word of their payload
+#define FAST_WORDS (1 + FAST_BINS)
+
+static inline char * fast_map(void) {
+    return heap_ptr - (LISTSIZE + MAPSIZE + HEAP_WORDS + ARENA_WORDS + PURGE_WORDS
+                       + TUNE_WORDS + TREE_WORDS + BIN_WORDS + 2) * WSIZE;
+}
+
+static inline char * fast_bin(int index) {
+    return heap_ptr - (LISTSIZE + MAPSIZE + HEAP_WORDS + ARENA_WORDS + PURGE_WORDS
+                       + TUNE_WORDS + TREE_WORDS + BIN_WORDS + 3 + index) * WSIZE;
+}
+
+#ifdef SLAB
+// before its fast bins, a heap keeps for every slab class the head of the
+// list of its runs that have free slots (a full run is in no list)
+#define SLAB_WORDS SLAB_CLASSES
+
+static inline char * slab_runs(int cls) {
+    return heap_ptr - (LISTSIZE + MAPSIZE + HEAP_WORDS + ARENA_WORDS + PURGE_WORDS
+                       + TUNE_WORDS + TREE_WORDS + BIN_WORDS + FAST_WORDS + 2 + cls) * WSIZE;
+}
+
+// a run is a page of slots of one slab class, starting with the links of the
+// list of runs it is in, its class, how many of its slots are free, and a
+// bitmap in which bit i is set iff slot i is free
+#define RUN_NEXT(run)   ((char *)(run))
+#define RUN_PREV(run)   ((char *)(run) + WSIZE)
+#define RUN_CLASS(run)  ((char *)(run) + 2*WSIZE)
+#define RUN_FREE(run)   ((char *)(run) + 3*WSIZE)
+#define RUN_MAP(run, i) ((char *)(run) + (4 + (i)) * WSIZE)
+#define RUN_SLOTS(run)  ((char *)(run) + (4 + RUN_MAPS) * WSIZE)
+
+#define SLOT_SIZE(cls)  (((size_t)(cls) + 1) * ALIGNMENT)
+#define RUN_COUNT(cls)  ((PAGESIZE - (4 + RUN_MAPS) * WSIZE) / SLOT_SIZE(cls))
+
+// the run of a slot, and whether a pointer is a slot at all
+#define RUN_OF(bp)  ((char *)((uintptr_t)(bp) & ~(uintptr_t)(PAGESIZE - 1)))
+#define IS_SLOT(bp) ((uintptr_t)((char *)(bp) - slab_base) < SLAB_SPAN)
+#else
+#define SLAB_WORDS 0
+#endif
+
+// how many words a heap keeps before its prologue
+#define HEAD_WORDS (SLAB_WORDS + FAST_WORDS + BIN_WORDS + TREE_WORDS + TUNE_WORDS \
+                    + PURGE_WORDS + ARENA_WORDS + HEAP_WORDS + MAPSIZE + LISTSIZE)
+
 /* Helper function declarations */
+static void * new_words(size_t size);          // memory outside of any block
+static int create_heap(void);                  // lists, prologue and epilogue
+static char * new_chunk(size_t * size);        // memory to extend the heap by
+static void * alloc_block(size_t size);        // malloc with the heap locked
+static void free_block(void * ptr);            // free with the heap locked
+static void merge_block(void * ptr);           // free without the fast bins
+static void shrink_block(void * ptr, size_t size);
 static void * extend_heap(size_t size);
+static size_t chunk_size(size_t size);         // how much to extend heap by
 static void * coalesce(void * ptr);
 static void * place(void * ptr, size_t size);
+static void * find_fit(size_t size);           // find a free block in the lists
 static void add_free(void * ptr, size_t size); // add free block to a free list
 static void pop_free(void * ptr);              // delete free block from a list
+static void bin_free(void * ptr);              // add free block to unsorted bin
+static void * sort_bin(size_t size);           // sort bin until a block fits
+static inline void fast_put(void * ptr, size_t size);
+static inline void * fast_get(size_t size);
+static int fast_flush(void);                   // merge fast bins into the heap
 static size_t align_size(size_t size);
+static inline void copy_payload(void * dst, const void * src, size_t n);
+#ifdef PURGE
+static void clear_payload(char * ptr, size_t n, char * start, char * end);
+#endif
+static inline int index_of(size_t size);
+#ifndef TLSF
+static int create_classes(void);               // table of small size classes
+static inline size_t class_size(int index);
+static char * tree_insert(int index, void * ptr, size_t size, char ** pred);
+static void tree_delete(int index, void * ptr);
+#ifndef ADDR_ORDER
+static char * tree_fit(int index, size_t size); // smallest block big enough
+#endif
+#endif
+#ifndef PIN_THRESHOLD
+static void tune_sample(size_t size, int missed); // tune threshold of place
+#endif
+#ifdef PURGE
+static void purge(void);                       // give back pages of old blocks
+#endif
+#ifdef MMAP
+static void release_segment(void * ptr);       // unmap an unused segment
+static void release_heap(void);                // unmap all segments
+#endif
+#ifdef HUGE
+static void * huge_alloc(size_t size);         // map a block of its own
+static void huge_free(void * ptr);
+static void * huge_realloc(void * ptr, size_t size);
+#endif
+#ifdef SLAB
+static int slab_init(void);                    // reserve address space for slabs
+static void * slab_alloc(size_t size);         // slot with the heap locked
+static void slab_free(void * ptr);
+#endif
 #ifdef DEBUG
 static int mm_check();                         // heap consistency checker
 #endif
+#ifdef THREADS
+static inline int tcache_index(size_t size);
+static inline void * tcache_get(int index);
+static inline void tcache_put(int index, void * ptr);
+static int tcache_create(void);
+static void tcache_fill(int index, size_t size);
+static void tcache_flush(int index, int count);
+static void remote_free(void * ptr);
+#endif
 
 
 /*
@@ -119,24 +851,33 @@ int mm_init(void)
 #ifdef DEBUG
     mem_init();
 #endif
-    if ((heap_ptr = mem_sbrk((LISTSIZE + 4) * WSIZE)) == (void *) -1)
+#ifdef MMAP
+    // nothing is left of the old heap in the memory mem_sbrk would reuse
+    release_heap();
+#endif
+#ifdef SLAB
+    if (slab_init() < 0)
         return -1;
-
-    // alignment padding is not needed when WSIZE % 8, but makes code compatible
-    // with WSIZE % 4 but ALIGNMENT % 8 (e.g. 32 bit version, doubleword-aligned)
-    PUT(heap_ptr, 0);
-    PUT(heap_ptr + ((LISTSIZE + 1)*WSIZE), PACK(DSIZE, 1));  // prologue header
-    PUT(heap_ptr + ((LISTSIZE + 2)*WSIZE), PACK(DSIZE, 1));  // prologue footer
-    PUT(heap_ptr + ((LISTSIZE + 3)*WSIZE), PACK(0, 1));      // epilogue header
-
-    for (int i = 1; i < LISTSIZE + 1; ++i) {
-        PUT(heap_ptr + (i*WSIZE), 0);                        // free list pointers
+#endif
+#ifndef TLSF
+    if (create_classes() < 0)
+        return -1;
+#endif
+#ifdef THREADS
+    // thread caches and arena assignments into an old heap are no longer valid
+    ++heap_epoch;
+    if ((arenas = new_words(ARENAS * WSIZE)) == NULL)
+        return -1;
+    for (int i = 0; i < ARENAS; ++i) {
+        arena_tag = (unsigned long)i << ARENA_SHIFT;
+        if (create_heap() < 0)
+            return -1;
+        arenas[i] = heap_ptr;
     }
-    heap_ptr += (LISTSIZE + 2) * WSIZE;
-
-    // extend heap with a free block of CHUNKSIZE bytes
-    if (extend_heap(INITSIZE) == NULL)
+#else
+    if (create_heap() < 0)
         return -1;
+#endif
 
 #ifdef VERBOSE
     printf("\n\n************* Heap initialized *************\n\n");
@@ -155,33 +896,46 @@ int mm_init(void)
 void * mm_malloc(size_t size)
 {
     if (size == 0) return NULL;
+    void * bp;
+
+#ifdef SLAB
+    // tiny requests get a slot without a header rather than a block, unless
+    // the address space of the slabs is used up, and they fall back to a block
+    if (size <= SLAB_MAX) {
+        LOCK_HEAP();
+        bp = slab_alloc(size);
+        UNLOCK_HEAP();
+        if (bp != NULL)
+            return bp;
+    }
+#endif
 
-    // since we include predecessor and successor pointers in a free block
-    // minimum block size is 4 words
+    // since we include predecessor and successor pointers and a footer in a
+    // free block, minimum block size is 4 words
     size = align_size(size);
 
-    // look for a fitting size from free lists
-    // and since we order within each free list from small to larger size blocks,
-    // we just need to check the block pointed from the free list pointer
-    // which is at the beginning of the heap (before the prologue)
-    int index = 0;
-    void * bp = NULL;
-    while (index < LISTSIZE) {
-        if (GET(freelists(index)) != 0 &&
-            GET_SIZE(HDRP(*(char**)freelists(index))) > size) {
-            bp = *(char **)freelists(index);
-            break;
-        }
-        ++index;
-    }
+#ifdef HUGE
+    // huge blocks do not go through the heap at all
+    if (size >= HUGE_MIN)
+        return huge_alloc(size);
+#endif
 
-    // if no free block is found
-    if (!bp) {
-        if ((bp = extend_heap(MAX(size, CHUNKSIZE))) == NULL)
-            return NULL;
-    }
-    // allocate new block in the free block we found or extended
-    bp = place(bp, size);
+#ifdef THREADS
+    // small blocks come from this thread's cache if possible, otherwise the
+    // empty bin is refilled in a batch while we hold the lock anyway
+    int tindex = tcache_index(size);
+    if (tindex >= 0 && tcache_epoch == heap_epoch &&
+        (bp = tcache_get(tindex)) != NULL)
+        return bp;
+#endif
+
+    LOCK_HEAP();
+    bp = alloc_block(size);
+#ifdef THREADS
+    if (bp != NULL && tindex >= 0 &&
+        (tcache_epoch == heap_epoch || tcache_create()))
+        tcache_fill(tindex, size);
+#endif
 
 #ifdef VERBOSE
     printf("Malloc'd for %lu bytes...\n", size);
@@ -189,6 +943,7 @@ void * mm_malloc(size_t size)
 #ifdef DEBUG
     mm_check();
 #endif
+    UNLOCK_HEAP();
 
     return bp;
 }
@@ -198,19 +953,60 @@ void * mm_malloc(size_t size)
  */
 void mm_free(void * bp)
 {
-    size_t size = GET_SIZE(HDRP(bp));
-    PUT(HDRP(bp), PACK(size, 0));
-    PUT(FTRP(bp), PACK(size, 0));
-    add_free(bp, size);
-    coalesce(bp);
+#ifdef SLAB
+    // (a slot has no header, so this comes before anything reads one)
+    if (IS_SLOT(bp)) {
+        LOCK_HEAP();
+        slab_free(bp);
+        UNLOCK_HEAP();
+        return;
+    }
+#endif
+#ifdef HUGE
+    if (GET_MAPPED(HDRP(bp))) {
+        huge_free(bp);
+        return;
+    }
+#endif
+#ifdef THREADS
+    // small blocks go to this thread's cache, and a full bin is flushed
+    // halfway back to the heap first
+    // (the size in the header of an allocated block never changes, only its
+    // prev-allocated bit does, so it can be loaded without the lock)
+    int tindex = tcache_index(LOAD_SIZE(HDRP(bp)));
+    if (tindex >= 0) {
+        if (tcache_epoch != heap_epoch) {
+            LOCK_HEAP();
+            tcache_create();
+            UNLOCK_HEAP();
+        }
+        if (tcache_epoch == heap_epoch) {
+            if (GET(tcache_len(tindex)) >= TCACHE_COUNT)
+                tcache_flush(tindex, TCACHE_COUNT / 2);
+            tcache_put(tindex, bp);
+            return;
+        }
+    }
+#endif
+
+#ifdef THREADS
+    // a block of another arena is left to that arena's owner
+    if (arena_epoch == heap_epoch && GET_ARENA(HDRP(bp)) != my_arena) {
+        remote_free(bp);
+        return;
+    }
+#endif
 
+    LOCK_OWNER(bp);
 #ifdef VERBOSE
-    printf("Freed %lu bytes at %p...\n", size, bp);
+    printf("Freed %lu bytes at %p...\n", GET_SIZE(HDRP(bp)), bp);
 #endif
+    free_block(bp);
+
 #ifdef DEBUG
     mm_check();
 #endif
-
+    UNLOCK_HEAP();
 }
 
 /*
@@ -219,279 +1015,1563 @@ void mm_free(void * bp)
 void * mm_realloc(void * bp, size_t size)
 {
     if (size == 0) return NULL;
+
+#ifdef SLAB
+    // a slot keeps a payload that fits it, anything bigger moves out
+    if (IS_SLOT(bp)) {
+        size_t slot_size = SLOT_SIZE(GET(RUN_CLASS(RUN_OF(bp))));
+        void * new_bp;
+        if (size <= slot_size)
+            return bp;
+        if ((new_bp = mm_malloc(size)) == NULL)
+            return NULL;
+        memcpy(new_bp, bp, slot_size);    // slots are too small for copy_payload
+        mm_free(bp);
+        return new_bp;
+    }
+#endif
     size = align_size(size);
 
+#ifdef HUGE
+    if (GET_MAPPED(HDRP(bp)))
+        return huge_realloc(bp, size);
+#endif
+
     // case 0: return bp directly if size is less than size of bp
-    if (GET_SIZE(HDRP(bp)) >= size)
+    // if what bp does not need any more makes a block, that is freed
+    if (LOAD_SIZE(HDRP(bp)) >= size) {
+        if (LOAD_SIZE(HDRP(bp)) - size >= 4 * WSIZE) {
+            LOCK_OWNER(bp);
+            shrink_block(bp, size);
+#ifdef DEBUG
+            mm_check();
+#endif
+            UNLOCK_HEAP();
+        }
         return bp;
+    }
 
-    int rem_size;
-    int next_epi  = !GET_SIZE(HDRP(NEXT_BLKP(bp)));
-    int next_free = !GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+    LOCK_OWNER(bp);
+    size_t cur_size  = GET_SIZE(HDRP(bp));
+    size_t next_size = GET_ALLOC(HDRP(NEXT_BLKP(bp))) ? 0 : GET_SIZE(HDRP(NEXT_BLKP(bp)));
+    size_t prev_size = GET_PREV_ALLOC(HDRP(bp)) ? 0 : GET_SIZE(HDRP(PREV_BLKP(bp)));
+    // whether the free blocks after bp, if any, reach the epilogue
+    int next_epi = !GET_SIZE(HDRP(NEXT_BLKP(bp))) ||
+                   (next_size && !GET_SIZE(HDRP(NEXT_BLKP(NEXT_BLKP(bp)))));
     void * new_bp = bp;
+#ifdef HUGE
+    // a block growing huge leaves the heap, rather than extending it
+    if (size >= HUGE_MIN)
+        next_size = prev_size = next_epi = 0;
+#endif
 
-    // case 1: next blocks are usable
-    if (next_free || next_epi) {
-        rem_size = GET_SIZE(HDRP(bp)) + GET_SIZE(HDRP(NEXT_BLKP(bp))) - size;
-        // case 1-a: next blocks usable, but not enough
-        if (rem_size < 0) {
-            if (extend_heap(MAX(CHUNKSIZE, -rem_size)) == NULL)
-                return NULL;
-            rem_size += MAX(CHUNKSIZE, -rem_size);
+    // case 1: neighboring free blocks are usable
+    // case 1-a: they are not enough, but the next ones reach the epilogue
+    // extending helps, but the new chunk only joins them if it was not put in
+    // a new segment
+    // a block this big at the end of the heap usually got there by growing, and
+    // will grow again, so the heap grows by as much as the block already has
+    // (up to GROWMAX), and a buffer appended to takes O(log n) extensions
+    if (cur_size + prev_size + next_size < size && next_epi) {
+        size_t need = size - cur_size - next_size;
+        size_t grow = MAX(MIN(cur_size, GROWMAX), MAX(need, CHUNKSIZE));
+        if ((new_bp = extend_heap(grow)) == NULL) {
+            UNLOCK_HEAP();
+            return NULL;
         }
-        // case 1-b: next block usable, and sufficed or now suffices
-        pop_free(NEXT_BLKP(bp));
-        PUT(HDRP(bp), PACK(size + rem_size, 1));
-        PUT(FTRP(bp), PACK(size + rem_size, 1));
+        if (new_bp == NEXT_BLKP(bp))
+            next_size = GET_SIZE(HDRP(new_bp));
+        new_bp = bp;
+    }
+
+    if (cur_size + prev_size + next_size >= size) {
+        // case 1-b: next block sufficed or now suffices, bp grows in place
+        if (cur_size + next_size >= size) {
+            pop_free(NEXT_BLKP(bp));
+            PUT(HDRP(bp), PACK(cur_size + next_size, 1 | GET_PREV_ALLOC(HDRP(bp))));
+            SET_PREV_ALLOC(NEXT_BLKP(bp));
+        }
+        // case 1-c: previous block suffices, together with the next one if
+        // that is free too; the payload moves back to the previous block
+        else {
+            new_bp = PREV_BLKP(bp);
+            pop_free(new_bp);
+            if (next_size)
+                pop_free(NEXT_BLKP(bp));
+            PUT(HDRP(new_bp), PACK(prev_size + cur_size + next_size,
+                                   1 | GET_PREV_ALLOC(HDRP(new_bp))));
+            SET_PREV_ALLOC(NEXT_BLKP(new_bp));
+            memmove(new_bp, bp, cur_size - WSIZE);
+        }
+        // either way, what the block does not need is freed again, if it can
+        if (GET_SIZE(HDRP(new_bp)) - size >= 4 * WSIZE)
+            shrink_block(new_bp, size);
+#ifdef DEBUG
+        mm_check();
+#endif
+        UNLOCK_HEAP();
     }
 
-    // case 2: next blocks are not usable, call mm_maloc and free old block
+    // case 2: neighboring blocks are not usable, call mm_maloc and free old block
     else {
-        new_bp = mm_malloc(size);
-        memcpy(new_bp, bp, GET_SIZE(HDRP(bp)));
+        UNLOCK_HEAP();
+        // if there is no memory left, the old block is left as it was
+        // (size is aligned already, so mm_malloc is asked for its payload)
+        if ((new_bp = mm_malloc(size - WSIZE)) == NULL)
+            return NULL;
+        copy_payload(new_bp, bp, LOAD_SIZE(HDRP(bp)) - WSIZE);
         mm_free(bp);
     }
 
 #ifdef VERBOSE
     printf("Realloc'd block at %p to %lu bytes...\n", bp, size);
-#endif
-#ifdef DEBUG
-    mm_check();
 #endif
     return new_bp;
 }
 
+/*
+ * Allocate zeroed memory for an array of nmemb elements of size bytes
+ * Memory known to be zero is not cleared again: a huge block is a fresh
+ * mapping, and with PURGE, the pages of a purged block (or of a chunk fresh
+ * from a mapping) are zero; memory from mem_sbrk may have been used before
+ */
+void * mm_calloc(size_t nmemb, size_t size)
+{
+    size_t bytes;
+    void * bp;
+
+    // nmemb * size must not wrap around, and neither may the block size that
+    // adds a header, alignment and, for a huge block, a page to it
+    if (__builtin_mul_overflow(nmemb, size, &bytes) || bytes == 0 ||
+        bytes > SIZE_MAX - 2*DSIZE - PAGESIZE)
+        return NULL;
+
+#if defined(HUGE) || defined(PURGE)
+    size_t asize = align_size(bytes);
+#ifdef SLAB
+    if (bytes <= SLAB_MAX)
+        asize = 0;
+#endif
+#ifdef HUGE
+    if (asize >= HUGE_MIN)
+        return huge_alloc(asize);
+#endif
+#ifdef PURGE
+    // only a block this big can have been purged, and place records which of
+    // its pages are zero while the heap is still locked
+    if (asize >= PURGE_MIN) {
+        LOCK_HEAP();
+        PUT(zero_start(), 0);
+        PUT(zero_end(), 0);
+        bp = alloc_block(asize);
+        char * start = (char *)GET(zero_start());
+        char * end   = (char *)GET(zero_end());
+#ifdef DEBUG
+        mm_check();
+#endif
+        UNLOCK_HEAP();
+        if (bp != NULL)
+            clear_payload(bp, bytes, start, end);
+        return bp;
+    }
+#endif
+#endif
+
+    if ((bp = mm_malloc(bytes)) != NULL)
+        memset(bp, 0, bytes);
+    return bp;
+}
+
+
+
+
+/********************************
+ * Helper functions
+ ********************************/
+
+/*
+ * Get size bytes of memory that is not part of any segment, NULL if there are
+ * none left; there is no way to give them back short of a new heap
+ */
+static void * new_words(size_t size)
+{
+#ifdef MMAP
+    void * p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+#else
+    void * p = mem_sbrk(size);
+    return p == (void *) -1 ? NULL : p;
+#endif
+}
+
+/*
+ * Create a heap (with THREADS, an arena) and make it the current one:
+ * bitmaps and free list pointers, followed by prologue and epilogue
+ */
+static int create_heap(void)
+{
+    char * bp;
+    if ((bp = new_words((HEAD_WORDS + 3) * WSIZE)) == NULL)
+        return -1;
+
+    // alignment padding is not needed when WSIZE % 8, but makes code compatible
+    // with WSIZE % 4 but ALIGNMENT % 8 (e.g. 32 bit version, doubleword-aligned)
+    // the bitmap words double as the padding, as MAPSIZE + LISTSIZE is odd
+    for (int i = 0; i < HEAD_WORDS; ++i) {
+        PUT(bp + (i*WSIZE), 0);    // heap words, bitmaps and free list pointers
+    }
+    heap_ptr = bp + (HEAD_WORDS + 1) * WSIZE;
+
+    // nothing before the prologue can be coalesced, so it is marked as if the
+    // previous block were allocated, and so is the epilogue after it
+    PUT(HDRP(heap_ptr), PACK(DSIZE, 1 | PREV_ALLOC));    // prologue header
+    PUT(heap_ptr, NULL);             // prologue footer, no segment before it
+    PUT(heap_ptr + WSIZE, PACK(0, 1 | PREV_ALLOC));      // epilogue header
+    PUT(heap_seg(), heap_ptr);
+    PUT(heap_end(), heap_ptr + DSIZE);
+    PUT(heap_step(), CHUNKSIZE);
+    PUT(heap_quiet(), CHUNK_DECAY);        // the first extension is no burst
+
+#ifdef THREADS
+    pthread_mutex_init(arena_lock(heap_ptr), NULL);
+#endif
+#ifdef PURGE
+    PUT(purge_clock(), 1);                 // so that no block is freed at time 0
+#endif
+#ifndef PIN_THRESHOLD
+    for (int i = 0; i < TUNE_CLASSES; ++i) {
+        PUT(tune_word(i, TUNE_THRESHOLD), THRESHOLD);
+        PUT(tune_word(i, TUNE_SCORE), 1024);
+    }
+#endif
+
+    // extend heap with a free block of INITSIZE bytes
+    if (extend_heap(INITSIZE) == NULL)
+        return -1;
+    return 0;
+}
+
+/*
+ * Allocate a block of an aligned size, the heap must be locked
+ */
+static void * alloc_block(size_t size)
+{
+    void * bp;
+
+    // a block of this very size freed lately is taken as it is
+    if (size <= FAST_MAX && (bp = fast_get(size)) != NULL) {
+        PURGE_TICK();
+        return bp;
+    }
+    // a large request makes the small blocks freed lately available to it
+    if (size >= FAST_FLUSH)
+        fast_flush();
+
+    // look for a fitting size from the unsorted bin, then from free lists
+    // and before the heap grows, once more with the fast bins merged back
+    bp = sort_bin(size);
+    if (bp == NULL)
+        bp = find_fit(size);
+    if (bp == NULL && fast_flush() && (bp = sort_bin(size)) == NULL)
+        bp = find_fit(size);
+
+#ifndef PIN_THRESHOLD
+    tune_sample(size, bp == NULL);
+#endif
+    // if no free block is found
+    if (!bp) {
+        if ((bp = extend_heap(chunk_size(size))) == NULL)
+            return NULL;
+    } else {
+        PUT(heap_quiet(), GET(heap_quiet()) + 1);
+    }
+    PURGE_TICK();
+    // allocate new block in the free block we found or extended
+    return place(bp, size);
+}
+
+/*
+ * Free a block, into its fast bin if it is small, otherwise like merge_block;
+ * the heap must be locked
+ */
+static void free_block(void * bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+
+    if (size <= FAST_MAX)
+        fast_put(bp, size);
+    else
+        merge_block(bp);
+    PURGE_TICK();
+}
+
+/*
+ * Free a block, coalesce, and put it in the unsorted bin; the heap must be
+ * locked
+ */
+static void merge_block(void * bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+
+    PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
+    PUT(FTRP(bp), PACK(size, 0));
+    CLR_PREV_ALLOC(NEXT_BLKP(bp));
+    bp = coalesce(bp);
+    bin_free(bp);
+#ifdef MMAP
+    release_segment(bp);
+#endif
+}
+
+/*
+ * Split the tail off an allocated block, leaving size bytes, and free it;
+ * the heap must be locked
+ * (the tail is coalesced right away, as it is no block anybody freed)
+ */
+static void shrink_block(void * bp, size_t size)
+{
+    size_t rem_size = GET_SIZE(HDRP(bp)) - size;
+    PUT(HDRP(bp), PACK(size, 1 | GET_PREV_ALLOC(HDRP(bp))));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(rem_size, 1 | PREV_ALLOC));
+    merge_block(NEXT_BLKP(bp));
+}
+
+// helper function: copy a payload of n bytes, a multiple of WSIZE, between
+// two blocks; up to 2 double words, which is most of the small blocks, it is
+// copied as its first and last double word (overlapping unless n is exactly
+// 2 double words) without a call; bigger payloads are left to memcpy, which
+// picks vector stores, and non-temporal ones for very large copies, itself
+static inline void copy_payload(void * dst, const void * src, size_t n)
+{
+    if (n <= 2 * DSIZE) {
+        memcpy(dst, src, DSIZE);
+        memcpy((char *)dst + n - DSIZE, (const char *)src + n - DSIZE, DSIZE);
+    } else {
+        memcpy(dst, src, n);
+    }
+}
+
+#ifdef PURGE
+// helper function: zero n bytes at bp, except for those in [start, end),
+// which are zero already; like copy_payload, this leaves it to memset to pick
+// vector or non-temporal stores
+static void clear_payload(char * bp, size_t n, char * start, char * end)
+{
+    if (start >= end || end <= bp || start >= bp + n) {
+        memset(bp, 0, n);
+        return;
+    }
+    if (start > bp)
+        memset(bp, 0, start - bp);
+    if (end < bp + n)
+        memset(end, 0, bp + n - end);
+}
+#endif
+
+// helper function: given a size, return an aligned size
+// an allocated block only needs room for its header, but it must be able to
+// hold the header, pointers and footer of a free block once it is freed
+// with ROUND_CLASSES, a size up to CLASS_LOOKUP is rounded up to its size
+// class as well, so that a block freed in a class fits any later request of
+// that class exactly, at the cost of up to a quarter of the block
+static size_t align_size(size_t size)
+{
+    if (size <= 3 * WSIZE) {
+        size = 2 * DSIZE;
+    } else {
+        size = ALIGN(size + WSIZE);
+    }
+#if defined(ROUND_CLASSES) && !defined(TLSF)
+    if (size <= CLASS_LOOKUP)
+        size = class_size(index_of(size));
+#endif
+    return size;
+}
+
+/*
+ * Return how many bytes to extend the heap by for a block of size bytes
+ * The step doubles whenever the heap runs out again within CHUNK_DECAY mallocs,
+ * up to CHUNKMAX, and halves for every CHUNK_DECAY mallocs it lasted instead,
+ * down to CHUNKSIZE; the chunk is rounded so that the heap ends on a page
+ */
+static size_t chunk_size(size_t size)
+{
+    size_t step = GET(heap_step());
+    unsigned long quiet = GET(heap_quiet());
+    if (quiet < CHUNK_DECAY)
+        step = MIN(2 * step, CHUNKMAX);
+    else
+        step = MAX(step >> MIN(quiet / CHUNK_DECAY, 8 * sizeof(size_t) - 1), CHUNKSIZE);
+    PUT(heap_step(), step);
+    PUT(heap_quiet(), 0);
+
+    uintptr_t end = (uintptr_t)*(char **)heap_end();
+    return ((end + MAX(size, step) + PAGESIZE - 1) & ~(uintptr_t)(PAGESIZE - 1)) - end;
+}
+
+/*
+ * Return a pointer to the header of a new chunk
+ */
+static void * extend_heap(size_t size)
+{
+#ifdef VERBOSE
+    printf("Extending heap by %lu bytes...\n", size);
+#endif
+
+    char * bp;
+    size = ALIGN(size);
+
+    // bp points to the first word of the chunk next to old epilogue
+    // consequently, old epilogue becomes the header of the new chunk
+    // (or the word standing in for it, if the chunk is in a new segment)
+    if ((bp = new_chunk(&size)) == NULL)
+        return NULL;
+    PUT(heap_end(), bp + size);
+
+    // the old epilogue knows whether the block before the new chunk is allocated
+    PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp)))); // header of new block
+    PUT(FTRP(bp), PACK(size, 0));          // set footer of new free block
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));  // set new epilogue header
+
+    // combine the new free block with any contiguous preceding free blocks
+#if defined(PURGE) && defined(MMAP)
+    char * chunk = bp;
+#endif
+    bp = coalesce(bp);
+    bin_free(bp);
+#if defined(PURGE) && defined(MMAP)
+    // a chunk of a fresh mapping that stays a block of its own is all zero
+    // pages but for its first words, just like a purged block
+    if (bp == chunk && size >= PURGE_MIN)
+        PUT(FREED_AT(bp), 0);
+#endif
+    return bp;
+}
+
+// helper function: lay out the prologue of a new segment at p, linked to the
+// newest segment, and return the chunk after it, with a word standing in for
+// an epilogue before it
+static char * start_segment(char * p)
+{
+    PUT(p, PACK(DSIZE, 1 | PREV_ALLOC));           // prologue header
+    PUT(p + WSIZE, last_segment());                // prologue footer
+    PUT(heap_seg(), p + WSIZE);
+    PUT(p + 2*WSIZE, PACK(0, 1 | PREV_ALLOC));
+    return p + 3*WSIZE;
+}
+
+#ifdef MMAP
+/*
+ * Map a chunk of at least size bytes and update size to what it holds, NULL
+ * if the mapping fails; the heap asks the kernel for the place right after
+ * its newest epilogue, and only starts a new segment if it gets another one
+ * Every chunk is twice the size of the newest segment (up to SEGMAX), so that
+ * a big heap takes few mappings, and few of its segments end up empty
+ */
+static char * new_chunk(size_t * size)
+{
+    char * end = *(char **)heap_end();
+    size_t newest = end - (last_segment() - WSIZE);
+    size_t length = MAX(*size + 3*WSIZE, MAX(SEGSIZE, MIN(2 * newest, SEGMAX)));
+    length = (length + PAGESIZE - 1) & ~(size_t)(PAGESIZE - 1);
+    char * bp = mmap(end, length, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bp == MAP_FAILED)
+        return NULL;
+    if (bp == end) {
+        *size = length;
+        return bp;
+    }
+    *size = length - 3*WSIZE;
+    return start_segment(bp);
+}
+
+/*
+ * Unmap the segment of free block bp if the block is all there is in it,
+ * unless it is the first or the newest segment of the heap
+ */
+static void release_segment(void * bp)
+{
+    // a block alone in its segment lies between the prologue and the epilogue
+    // (the header check is only a filter, the segment list has the last word)
+    if (GET_SIZE(HDRP(NEXT_BLKP(bp))) != 0 ||
+        GET((char *)bp - 3*WSIZE) != PACK(DSIZE, 1 | PREV_ALLOC))
+        return;
+
+    char * next = last_segment();
+    char * seg  = prev_segment(next);
+    while (seg != NULL && seg + DSIZE != (char *)bp) {
+        next = seg;
+        seg  = prev_segment(seg);
+    }
+    if (seg == NULL || seg == heap_ptr)
+        return;
+
+    pop_free(bp);
+    PUT(next, prev_segment(seg));
+    munmap(seg - WSIZE, GET_SIZE(HDRP(bp)) + 3*WSIZE);
+}
+
+/*
+ * Unmap every segment of the current heap, including its heap words
+ */
+static void release_segments(void)
+{
+    char * seg = last_segment();
+    char * prev;
+    for (; seg != NULL; seg = prev) {
+        prev = prev_segment(seg);
+        char * bp = seg;
+        while (GET_SIZE(HDRP(bp)) != 0)
+            bp = NEXT_BLKP(bp);
+        char * start = (seg == heap_ptr) ? seg - (HEAD_WORDS + 1) * WSIZE
+                                         : seg - WSIZE;
+        munmap(start, bp - start);
+    }
+}
+
+/*
+ * Unmap the heap, if there is one, before a new one is created
+ */
+static void release_heap(void)
+{
+#ifdef THREADS
+    if (arenas == NULL)
+        return;
+    for (int i = 0; i < ARENAS; ++i) {
+        heap_ptr = arenas[i];
+        release_segments();
+    }
+    munmap(arenas, ARENAS * WSIZE);
+    arenas = NULL;
+#else
+    if (heap_ptr == NULL)
+        return;
+    release_segments();
+#endif
+    heap_ptr = NULL;
+#ifndef TLSF
+    munmap(class_table, ALIGN(CLASS_LOOKUP / ALIGNMENT));
+    class_table = NULL;
+#endif
+}
+
+#else
+/*
+ * Get a chunk of size bytes from mem_sbrk, NULL if there are none left
+ * With THREADS, arenas share the break, so if another arena has grown the heap
+ * since, the chunk starts a new segment
+ */
+static char * new_chunk(size_t * size)
+{
+    char * bp;
+    LOCK_SBRK();
+    if ((char *)mem_heap_hi() + 1 == *(char **)heap_end())
+        bp = mem_sbrk(*size);
+    else if ((bp = mem_sbrk(*size + 3*WSIZE)) != (char *)-1)
+        bp = start_segment(bp);
+    UNLOCK_SBRK();
+    return bp == (char *)-1 ? NULL : bp;
+}
+#endif
+
+
+/*
+ * Coalesce free block bp, which is in no list, with previous and/or next
+ * blocks, and return the coalesced block, which is in no list either
+ */
+static void * coalesce(void * bp)
+{
+    int prev_free = !GET_PREV_ALLOC(HDRP(bp));
+    int next_free = !GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+    size_t size   = GET_SIZE(HDRP(bp));
+
+    // no neighboring free blocks
+    if (!prev_free && !next_free)
+        return bp;
+
+    // coalesce with previous block if it is free
+    if (prev_free) {
+        pop_free(PREV_BLKP(bp));
+        size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+        PUT(FTRP(bp), PACK(size, 0));
+        PUT(HDRP(PREV_BLKP(bp)), PACK(size, GET_PREV_ALLOC(HDRP(PREV_BLKP(bp)))));
+        bp = PREV_BLKP(bp);
+    }
+
+    // coalesce with next block if it is free
+    if (next_free) {
+        pop_free(NEXT_BLKP(bp));
+        size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+        PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
+        PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
+    }
+
+    return bp;
+}
+
+
+// helper function: front-load or back-load a payload in a free block
+// only the free part gets a footer, and the block after the allocated part
+// gets its prev-allocated bit set
+static void inline place_fb (void * bp, size_t fsize, size_t bsize, int alloc)
+{
+    PUT(HDRP(bp), PACK(fsize, alloc | GET_PREV_ALLOC(HDRP(bp))));
+    if (alloc) {
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(bsize, PREV_ALLOC));
+        PUT(FTRP(NEXT_BLKP(bp)), PACK(bsize, 0));
+    } else {
+        PUT(FTRP(bp), PACK(fsize, 0));
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(bsize, 1));
+        SET_PREV_ALLOC(NEXT_BLKP(NEXT_BLKP(bp)));
+    }
+}
+
+/*
+ * To malloc, place the payload of size size into the block bp we just found
+ */
+static void * place(void * bp, size_t size)
+{
+    size_t total_size = GET_SIZE(HDRP(bp));
+    size_t rem_size = total_size - size;
+#ifdef PURGE
+    // the pages of what remains of a purged block have not been touched, and
+    // the part of them that ends up in the payload is left for mm_calloc
+    int purged = total_size >= PURGE_MIN && GET(FREED_AT(bp)) == 0;
+    if (purged) {
+        PUT(zero_start(), ((uintptr_t)bp + 5*WSIZE + PAGESIZE - 1) & ~(uintptr_t)(PAGESIZE - 1));
+        PUT(zero_end(), (uintptr_t)FTRP(bp) & ~(uintptr_t)(PAGESIZE - 1));
+    }
+#endif
+    pop_free(bp);
+
+    // case 1: remaining space is less than the minimal size (4 words)
+    if (rem_size < 4 * WSIZE) {
+        PUT(HDRP(bp), PACK(total_size, 1 | GET_PREV_ALLOC(HDRP(bp))));
+        SET_PREV_ALLOC(NEXT_BLKP(bp));
+    }
+
+    // for case 2 and 3, we essentially want to decide whether to allocate the
+    // first portion of the free block for the payload or the latter portion
+    // the threshold is based on the experiments, and tuned per size class
+    // while running unless it is pinned, see tune_sample
+    // case 2: remaining space sufficient, and the remaining size relatively big
+    else if (rem_size >= THRESHOLD_OF(size) * size) {
+        place_fb(bp, size, rem_size, 1);
+        PURGE_STAMP(NEXT_BLKP(bp), rem_size);
+        add_free(NEXT_BLKP(bp), rem_size); // add remaining free block to free list
+#ifdef PURGE
+        if (purged && rem_size >= PURGE_MIN)
+            PUT(FREED_AT(NEXT_BLKP(bp)), 0);
+#endif
+    }
+
+    // case 3: remaining space sufficient, and the remaining size relatively small
+    else {
+        place_fb(bp, rem_size, size, 0);
+        PURGE_STAMP(bp, rem_size);
+        add_free(bp, rem_size);
+#ifdef PURGE
+        if (purged && rem_size >= PURGE_MIN)
+            PUT(FREED_AT(bp), 0);
+#endif
+        return NEXT_BLKP(bp);
+    }
+
+    return bp;
+}
+
+
+#ifdef TLSF
+// helper function: given a size, return an index in the free list
+// the first level fl is floor(log2(size)) - log2(4*WSIZE), and the second level
+// sl is given by the SL_LOG2 bits right below the highest set bit of size
+// sizes beyond the last class all go to the last list
+static inline int index_of(size_t size)
+{
+    int fl = 8 * sizeof(unsigned long) - 1 - __builtin_clzl(size);
+    if (fl - LOG_4WSIZE >= FL_COUNT)
+        return LISTSIZE - 1;
+    return (fl - LOG_4WSIZE) * SL_COUNT + ((size >> (fl - SL_LOG2)) & (SL_COUNT-1));
+}
+
+/*
+ * Find a free block of at least size bytes, NULL if there is none
+ */
+static void * find_fit(size_t size)
+{
+    // round size up to the next list boundary, so that every block in the list
+    // we search from is big enough; then the bitmaps give the first non-empty
+    // list in that class, or else in the next non-empty class
+    int fl = 8 * sizeof(unsigned long) - 1 - __builtin_clzl(size);
+    int index = index_of(size + (1UL << (fl - SL_LOG2)) - 1);
+    fl = index / SL_COUNT;
+    unsigned long map = GET(listmap(1 + fl)) & (~0UL << (index % SL_COUNT));
+
+    if (map == 0) {
+        unsigned long flmap = GET(listmap(0)) & (~0UL << (fl + 1));
+        if (flmap == 0)
+            return NULL;
+        fl = __builtin_ctzl(flmap);
+        map = GET(listmap(1 + fl));
+    }
+    char * bp = *(char **)freelists(fl * SL_COUNT + __builtin_ctzl(map));
+
+    // the last list is unbounded, so its blocks still have to be checked
+    if (index == LISTSIZE - 1) {
+        while (bp != NULL && GET_SIZE(HDRP(bp)) < size)
+            bp = SUCC_BLKP(bp);
+    }
+    return bp;
+}
+
+#else
+// the size classes are 4*WSIZE and the sizes that split every power of two
+// from there into CLASS_STEPS equal steps, i.e. 32, 40, 48, 56, 64, 80, 96,
+// ... bytes on 64-bit; the i-th free list stores the blocks bigger than the
+// (i-1)-th class and up to the i-th, and the last one everything beyond
+
+// helper function: the size of the index-th class
+static inline size_t class_size(int index)
+{
+    return CLASS_SIZE(index);
+}
+
+// helper function: given a size, compute the index of the smallest class at
+// least as big, capped at the last list; the highest set bit of size - 1 and
+// the CLASS_LOG2 bits below it give the class right below size, and size
+// takes the one after
+static inline int class_of(size_t size)
+{
+    if (size <= 4*WSIZE)
+        return 0;
+    int fl = 8 * sizeof(unsigned long) - 1 - __builtin_clzl(size - 1);
+    int index = (fl - LOG_4WSIZE) * CLASS_STEPS
+              + (((size - 1) >> (fl - CLASS_LOG2)) & (CLASS_STEPS-1)) + 1;
+    return index < LISTSIZE - 1 ? index : LISTSIZE - 1;
+}
+
+// helper function: given a size, return an index in the free list, which is
+// the index of its class; small sizes look it up in class_table
+static inline int index_of(size_t size)
+{
+    if (size <= CLASS_LOOKUP)
+        return class_table[(size - 1) / ALIGNMENT];
+    return class_of(size);
+}
+
+/*
+ * Fill the table of the classes of the sizes up to CLASS_LOOKUP, which is
+ * kept outside of any segment, like the arena table; entry i is the class of
+ * the sizes up to (i+1) * ALIGNMENT, as class boundaries are aligned
+ */
+static int create_classes(void)
+{
+    if ((class_table = new_words(ALIGN(CLASS_LOOKUP / ALIGNMENT))) == NULL)
+        return -1;
+    for (int i = 0; i < CLASS_LOOKUP / ALIGNMENT; ++i)
+        class_table[i] = class_of((i + 1) * ALIGNMENT);
+    return 0;
+}
+
+/*
+ * Find a free block of at least size bytes, NULL if there is none
+ */
+static void * find_fit(size_t size)
+{
+    // since we order within each free list from small to larger size blocks,
+    // the first block big enough in a list is the best fit in it
+    // lists below index_of(size) only hold smaller blocks, and any block in a
+    // list above it is bigger than size, so only the list of size itself has
+    // to be searched; otherwise the bitmap gives the next candidate
+    // the list of size is walked for at most FIT_DEPTH blocks, as a block a
+    // little further down still beats the head of a bigger list, or a heap
+    // extension (a list that is a treap has its best fit looked up instead)
+    // with ADDR_ORDER, lists are ordered by address, so the walk gives the
+    // first fit, and the head of a bigger list is the first block in it
+    // (blocks in the fast bins are not in any list, and found without order);
+    // the last list is unbounded, so it is walked to the end, as nothing is after
+    int index = index_of(size);
+    unsigned long map = GET(listmap(0)) >> index;
+    char * bp;
+
+#ifndef ADDR_ORDER
+    if (index >= TREE_LIST && (map & 1) && (bp = tree_fit(index, size)) != NULL)
+        return bp;
+    if (index < TREE_LIST && (map & 1)) {
+#else
+    if (map & 1) {
+#endif
+        bp = *(char **)freelists(index);
+#ifdef ADDR_ORDER
+        int walk_all = index == LISTSIZE - 1;
+#else
+        int walk_all = 0;
+#endif
+        for (int depth = 0; bp != NULL && (walk_all || depth < FIT_DEPTH); ++depth) {
+            if (GET_SIZE(HDRP(bp)) >= size)
+                return bp;
+            bp = SUCC_BLKP(bp);
+        }
+    }
+    if ((map >>= 1) != 0)
+        return *(char **)freelists(index + 1 + __builtin_ctzl(map));
+    return NULL;
+}
+#endif
+
+
+/*
+ * Add a free block of size size to one of the free lists
+ */
+static void add_free(void * bp, size_t size)
+{
+    // find the corresponding free list for the size
+    int index = index_of(size);
+
+    // in the free list, find the corresponding block (first fit)
+    //    case 1: free list is empty
+    char * curr_ptr = !GET(freelists(index))? NULL : *(char **)freelists(index);
+    char * pred_ptr = curr_ptr;
+#ifndef TLSF
+    //    case 2: free list is not empty
+    //    (TLSF lists are unordered, so a block is always added at the front,
+    //    and a list that is a treap gives the blocks around bp without a walk;
+    //    with ADDR_ORDER, the lists below TREE_LIST hold blocks too small for
+    //    a treap node, and are walked for the place of bp by address instead)
+    if (index >= TREE_LIST)
+        curr_ptr = tree_insert(index, bp, size, &pred_ptr);
+#ifndef ADDR_ORDER
+    else while ((curr_ptr != NULL) && size > GET_SIZE(HDRP(curr_ptr))) {
+#else
+    else while ((curr_ptr != NULL) && (char *)bp > curr_ptr) {
+#endif
+        pred_ptr = curr_ptr;
+        curr_ptr = SUCC_BLKP(curr_ptr);
+    }
+#endif
+
+    // by the info we got so far, we know where to place the new free block
+    //  possibility 1: free list is empty
+    if (GET(freelists(index)) == 0) {
+        PUT(bp, NULL);
+        PUT((char *)bp + WSIZE, NULL);
+        PUT(freelists(index), bp);
+        mark_list(index);
+    }
+
+    //  possibility 2: free list is not empty, but ptr is NULL, meaning --
+    //                 we are adding the free block at the end of the free list
+    else if (curr_ptr == NULL) {
+        PUT(bp, pred_ptr);
+        PUT((char *)bp + WSIZE, NULL);
+        PUT((char *)pred_ptr + WSIZE, bp);
+    }
+
+    //  possibility 3: free list is not empty, ptr is the first block in free list
+    else if (curr_ptr == *(char **)freelists(index)) {
+        PUT(bp, NULL);
+        PUT((char *)bp + WSIZE, curr_ptr);
+        PUT(curr_ptr, bp);
+        PUT(freelists(index), bp);
+    }
+
+    //  possibility 4: free list is not empty, ptr is in the middle of free list
+    else {
+        PUT(bp, pred_ptr);
+        PUT((char *)bp + WSIZE, curr_ptr);
+        PUT(curr_ptr, bp);
+        PUT((char *)pred_ptr + WSIZE, bp);
+    }
+}
+
+
+/*
+ * Delete a block from a free list (or the unsorted bin) because it has just
+ * been allocated
+ */
+static void pop_free(void * bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+    int index = index_of(size);
+
+    // the bin is not sorted and has no bitmap, so only its links are updated
+    if (GET(HDRP(bp)) & UNSORTED) {
+        PUT(HDRP(bp), GET(HDRP(bp)) & ~UNSORTED);
+        if (PRED_BLKP(bp) == NULL)
+            PUT(unsorted_bin(), SUCC_BLKP(bp));
+        else
+            PUT((char *)PRED_BLKP(bp) + WSIZE, SUCC_BLKP(bp));
+        if (SUCC_BLKP(bp) != NULL)
+            PUT(SUCC_BLKP(bp), PRED_BLKP(bp));
+        return;
+    }
+
+#ifndef TLSF
+    if (index >= TREE_LIST)
+        tree_delete(index, bp);
+#endif
+
+    if (PRED_BLKP(bp) == NULL) {
+
+        //  possibility 1: predecessor is null, successor is null
+        if (SUCC_BLKP(bp) == NULL) {
+            PUT(freelists(index), 0);
+            unmark_list(index);
+        }
+        //  possibility 2: predecessor is null, successor is not null
+        else {
+            PUT(freelists(index), SUCC_BLKP(bp));
+            PUT(SUCC_BLKP(bp), NULL);
+        }
+    }
+
+    else {
+
+        //  possibility 3: predecessor is not null, successor is null
+        if (SUCC_BLKP(bp) == NULL) {
+            PUT((char *)PRED_BLKP(bp) + WSIZE, NULL);
+        }
+        //  possibility 4: predecessor is not null, successor is not null
+        else {
+            PUT((char *)PRED_BLKP(bp) + WSIZE, SUCC_BLKP(bp));
+            PUT((char *)SUCC_BLKP(bp), PRED_BLKP(bp));
+        }
+    }
+}
+
+
+/*
+ * Push a free block, which is in no list, onto the unsorted bin
+ */
+static void bin_free(void * bp)
+{
+    char * head = (char *)GET(unsorted_bin());
+    PURGE_STAMP(bp, GET_SIZE(HDRP(bp)));
+
+    PUT(HDRP(bp), GET(HDRP(bp)) | UNSORTED);
+    PUT(bp, NULL);
+    PUT((char *)bp + WSIZE, head);
+    if (head != NULL)
+        PUT(head, bp);
+    PUT(unsorted_bin(), bp);
+}
+
+/*
+ * Sort the blocks of the unsorted bin into the free lists, most recently freed
+ * first, until one of them fits size bytes without leaving a block behind;
+ * return that one, still in the bin, NULL if there is none
+ */
+static void * sort_bin(size_t size)
+{
+    char * bp;
+    while ((bp = (char *)GET(unsorted_bin())) != NULL) {
+        size_t bsize = GET_SIZE(HDRP(bp));
+        if (bsize >= size && bsize - size < 4 * WSIZE)
+            return bp;
+        pop_free(bp);
+        add_free(bp, bsize);
+    }
+    return NULL;
+}
+
+
+// helper function: push an allocated block of size bytes onto its fast bin
+static inline void fast_put(void * bp, size_t size)
+{
+    int index = (size - 4*WSIZE) / ALIGNMENT;
+    PUT(bp, GET(fast_bin(index)));
+    PUT(fast_bin(index), bp);
+    PUT(fast_map(), GET(fast_map()) | (1UL << index));
+}
+
+// helper function: pop a block of size bytes from its fast bin, NULL if the
+// bin is empty
+static inline void * fast_get(size_t size)
+{
+    int index = (size - 4*WSIZE) / ALIGNMENT;
+    char * bp = (char *)GET(fast_bin(index));
+    if (bp != NULL) {
+        PUT(fast_bin(index), GET(bp));
+        if (GET(bp) == 0)
+            PUT(fast_map(), GET(fast_map()) & ~(1UL << index));
+    }
+    return bp;
+}
+
+/*
+ * Free every block in the fast bins for real, coalescing it with its free
+ * neighbors; return 0 if the fast bins were empty
+ */
+static int fast_flush(void)
+{
+    unsigned long map = GET(fast_map());
+    if (map == 0)
+        return 0;
+
+    PUT(fast_map(), 0);
+    for (; map != 0; map &= map - 1) {
+        int index = __builtin_ctzl(map);
+        char * bp = (char *)GET(fast_bin(index));
+        PUT(fast_bin(index), 0);
+        while (bp != NULL) {
+            char * next = (char *)GET(bp);
+            merge_block(bp);
+            bp = next;
+        }
+    }
+    return 1;
+}
+
+
+#ifndef TLSF
+/**********************************
+ * Size treaps
+ **********************************/
+
+// helper function: whether a block bp of size size comes before block other,
+// blocks are ordered by size, and blocks of the same size by address
+// (with ADDR_ORDER, by address alone)
+static inline int tree_less(void * bp, size_t size, char * other)
+{
+#ifdef ADDR_ORDER
+    return (char *)bp < other;
+#else
+    size_t other_size = GET_SIZE(HDRP(other));
+    return size < other_size || (size == other_size && (char *)bp < other);
+#endif
+}
+
+/*
+ * Insert free block bp of size size into the treap of the index-th list,
+ * return the block right after it, and set pred to the block right before it
+ * (NULL if there is none), which is where bp goes in the list
+ */
+static char * tree_insert(int index, void * bp, size_t size, char ** pred)
+{
+    char ** link = (char **)tree_root(index);
+    char * succ = NULL;
+    *pred = NULL;
+
+    // go down while the blocks on the way have higher priority than bp
+    while (*link != NULL && TREE_PRIO(*link) >= TREE_PRIO(bp)) {
+        if (tree_less(bp, size, *link)) {
+            succ = *link;
+            link = &TREE_LEFT(*link);
+        } else {
+            *pred = *link;
+            link = &TREE_RIGHT(*link);
+        }
+    }
+
+    // bp takes the place of the subtree there, which is split into the blocks
+    // before bp, its left subtree, and the blocks after it, its right subtree
+    char * t = *link;
+    char ** left  = &TREE_LEFT(bp);
+    char ** right = &TREE_RIGHT(bp);
+    *link = bp;
+    while (t != NULL) {
+        if (tree_less(bp, size, t)) {
+            succ = t;
+            *right = t;
+            right = &TREE_LEFT(t);
+            t = *right;
+        } else {
+            *pred = t;
+            *left = t;
+            left = &TREE_RIGHT(t);
+            t = *left;
+        }
+    }
+    *left = *right = NULL;
+    return succ;
+}
+
+/*
+ * Delete free block bp from the treap of the index-th list
+ */
+static void tree_delete(int index, void * bp)
+{
+    size_t size = GET_SIZE(HDRP(bp));
+    char ** link = (char **)tree_root(index);
+    while (*link != bp)
+        link = tree_less(bp, size, *link) ? &TREE_LEFT(*link) : &TREE_RIGHT(*link);
+
+    // the subtrees of bp are merged in its place, along their inner spines
+    char * left  = TREE_LEFT(bp);
+    char * right = TREE_RIGHT(bp);
+    while (left != NULL && right != NULL) {
+        if (TREE_PRIO(left) >= TREE_PRIO(right)) {
+            *link = left;
+            link = &TREE_RIGHT(left);
+            left = *link;
+        } else {
+            *link = right;
+            link = &TREE_LEFT(right);
+            right = *link;
+        }
+    }
+    *link = left != NULL ? left : right;
+}
+
+#ifndef ADDR_ORDER
+/*
+ * Find the smallest block of at least size bytes in the treap of the
+ * index-th list, NULL if there is none
+ */
+static char * tree_fit(int index, size_t size)
+{
+    char * fit = NULL;
+    for (char * t = *(char **)tree_root(index); t != NULL; ) {
+        if (GET_SIZE(HDRP(t)) >= size) {
+            fit = t;
+            t = TREE_LEFT(t);
+        } else {
+            t = TREE_RIGHT(t);
+        }
+    }
+    return fit;
+}
+#endif
+#endif
+
+
+#ifndef PIN_THRESHOLD
+/**********************************
+ * Threshold tuning
+ **********************************/
+
+/*
+ * Count a malloc of size bytes, missed if no free block fit it, i.e. the heap
+ * had to grow, however much free memory is left in pieces; every TUNE_EPOCH
+ * mallocs of a size class, the threshold of that class is moved by one, in
+ * the same direction as before if the share of misses did not grow since the
+ * last move, and in the other direction otherwise
+ */
+static void tune_sample(size_t size, int missed)
+{
+    int cls = tune_class(size);
+    unsigned long mallocs = GET(tune_word(cls, TUNE_MALLOCS)) + 1;
+    unsigned long misses  = GET(tune_word(cls, TUNE_MISSES)) + missed;
 
+    if (mallocs < TUNE_EPOCH) {
+        PUT(tune_word(cls, TUNE_MALLOCS), mallocs);
+        PUT(tune_word(cls, TUNE_MISSES), misses);
+        return;
+    }
 
+    unsigned long score = misses * 1024 / mallocs;
+    unsigned long threshold = GET(tune_word(cls, TUNE_THRESHOLD));
+    int lowered = GET(tune_word(cls, TUNE_LOWERED));
+    if (score > GET(tune_word(cls, TUNE_SCORE)))
+        lowered = !lowered;
+    if (threshold == 1)
+        lowered = 0;
+    else if (threshold == TUNE_MAX)
+        lowered = 1;
+
+    PUT(tune_word(cls, TUNE_THRESHOLD), lowered ? threshold - 1 : threshold + 1);
+    PUT(tune_word(cls, TUNE_LOWERED), lowered);
+    PUT(tune_word(cls, TUNE_SCORE), score);
+    PUT(tune_word(cls, TUNE_MALLOCS), 0);
+    PUT(tune_word(cls, TUNE_MISSES), 0);
+}
+#endif
 
-/********************************
- * Helper functions
- ********************************/
 
-// helper function: given a size, return an aligned size
-static size_t align_size(size_t size)
+#ifdef PURGE
+/**********************************
+ * Purging
+ **********************************/
+
+// helper function: give back the pages in the interior of a free block,
+// keeping its header, list pointers, time it was freed, treap links and footer
+static void purge_block(void * bp)
 {
-    if (size <= DSIZE) {
-        size = 2 * DSIZE;
-    } else {
-        size = ALIGN(size + DSIZE);
-    }
-    return size;
+    uintptr_t start = ((uintptr_t)bp + 5*WSIZE + PAGESIZE - 1) & ~(uintptr_t)(PAGESIZE - 1);
+    uintptr_t end   = (uintptr_t)FTRP(bp) & ~(uintptr_t)(PAGESIZE - 1);
+    if (end > start)
+        madvise((void *)start, end - start, MADV_DONTNEED);
+    PUT(FREED_AT(bp), 0);
 }
 
 /*
- * Return a pointer to the header of a new chunk
+ * Purge every large free block freed at least PURGE_DECAY ticks ago,
+ * and remember when the oldest of the remaining ones was freed
+ * Blocks that keep being reused are never old enough, so churn does not
+ * cost a system call; only the lists that can hold large blocks are walked
  */
-static void * extend_heap(size_t size)
+static void purge(void)
 {
-#ifdef VERBOSE
-    printf("Extending heap by %lu bytes...\n", size);
+    unsigned long now = GET(purge_clock());
+    unsigned long oldest = 0;
+    sort_bin(0);    // only the lists are walked, and no block fits 0 bytes
+    for (int i = index_of(PURGE_MIN); i < LISTSIZE; ++i) {
+        char * bp = *(char **)freelists(i);
+        for (; bp != NULL; bp = SUCC_BLKP(bp)) {
+            unsigned long freed = GET(FREED_AT(bp));
+            if (GET_SIZE(HDRP(bp)) < PURGE_MIN || freed == 0)
+                continue;
+            if (now - freed >= PURGE_DECAY)
+                purge_block(bp);
+            else if (oldest == 0 || freed < oldest)
+                oldest = freed;
+        }
+    }
+    PUT(purge_oldest(), oldest);
+}
 #endif
 
-    char * bp;
-    size = ALIGN(size);
 
-    // bp points to the first word of the chunk next to old epilogue
-    // consequently, old epilogue becomes the header of the new chunk
-    if ((bp = mem_sbrk(size)) == (char *)-1)
-        return NULL;
 
-    PUT(HDRP(bp), PACK(size, 0));          // set header of new free block
-    PUT(FTRP(bp), PACK(size, 0));          // set footer of new free block
-    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));  // set new epilogue header
+#ifdef HUGE
+/**********************************
+ * Huge blocks
+ **********************************/
 
-    add_free(bp, size); // update free lists
+// a huge block is a private anonymous mapping, starting with the header of
+// the block, which holds the length of the mapping and the MAPPED bit;
+// it belongs to no heap (and no arena), so it needs no lock
 
-    // combine the new free block with any contiguous preceding free blocks
-    return coalesce(bp);
+/*
+ * Map a block of an aligned size, NULL if the mapping fails
+ */
+static void * huge_alloc(size_t size)
+{
+    size_t length = (size + PAGESIZE - 1) & ~(size_t)(PAGESIZE - 1);
+    char * p = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    PUT(p, length | MAPPED | 1);
+    return p + WSIZE;
 }
 
+static void huge_free(void * bp)
+{
+    munmap(HDRP(bp), GET_SIZE(HDRP(bp)));
+}
 
 /*
- * Coalesce with previous and/or next blocks
+ * Resize a huge block to an aligned size; the kernel moves its pages if the
+ * mapping cannot grow in place, so the payload is never copied, unless the
+ * block is no longer huge and moves back into the heap
  */
-static void * coalesce(void * bp)
+static void * huge_realloc(void * bp, size_t size)
 {
-    int prev_free = (!GET_ALLOC(HDRP(PREV_BLKP(bp))));
-    int next_free = !GET_ALLOC(HDRP(NEXT_BLKP(bp)));
-    int size      = GET_SIZE(HDRP(bp));
+    size_t length = (size + PAGESIZE - 1) & ~(size_t)(PAGESIZE - 1);
+    char * p;
 
-    // no neighboring free blocks
-    if (!prev_free && !next_free)
+    if (size < HUGE_MIN) {
+        if ((p = mm_malloc(size - WSIZE)) != NULL) {
+            copy_payload(p, bp, size - WSIZE);
+            huge_free(bp);
+        }
+        return p;
+    }
+    if (length == GET_SIZE(HDRP(bp)))
         return bp;
+    p = mremap(HDRP(bp), GET_SIZE(HDRP(bp)), length, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED)
+        return NULL;
+    PUT(p, length | MAPPED | 1);
+    return p + WSIZE;
+}
+#endif
 
-    pop_free(bp);
 
-    // coalesce with previous block if it is free
-    if (prev_free) {
-        pop_free(PREV_BLKP(bp));
-        size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-        PUT(FTRP(bp), PACK(size, 0));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-        bp = PREV_BLKP(bp);
-    }
+#ifdef SLAB
+/**********************************
+ * Slabs
+ **********************************/
 
-    // coalesce with next block if it is free
-    if (next_free) {
-        pop_free(NEXT_BLKP(bp));
-        size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
-        PUT(HDRP(bp), PACK(size, 0));
+/*
+ * Reserve the address space of the slabs, giving back that of an old heap;
+ * its pages are only backed by memory once runs are carved from them
+ */
+static int slab_init(void)
+{
+    if (slab_base != NULL)
+        munmap(slab_base, SLAB_SPAN);
+    slab_base = mmap(NULL, SLAB_SPAN, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (slab_base == MAP_FAILED) {
+        slab_base = NULL;
+        return -1;
     }
-
-    add_free(bp, size);
-    return bp;
+    slab_top = slab_base;
+    slab_spare = NULL;
+    return 0;
 }
 
+// helper function: add a run to the front of the list of its class
+static void run_link(int cls, char * run)
+{
+    char * head = (char *)GET(slab_runs(cls));
+    PUT(RUN_NEXT(run), head);
+    PUT(RUN_PREV(run), NULL);
+    if (head != NULL)
+        PUT(RUN_PREV(head), run);
+    PUT(slab_runs(cls), run);
+}
 
-// helper function: front-load or back-load a payload in a free block
-static void inline place_fb (void * bp, size_t fsize, size_t bsize, int alloc)
+// helper function: delete a run from the list of its class
+static void run_unlink(int cls, char * run)
 {
-    PUT(HDRP(bp), PACK(fsize, alloc));
-    PUT(FTRP(bp), PACK(fsize, alloc));
-    PUT(HDRP(NEXT_BLKP(bp)), PACK(bsize, !alloc));
-    PUT(FTRP(NEXT_BLKP(bp)), PACK(bsize, !alloc));
+    char * next = (char *)GET(RUN_NEXT(run));
+    char * prev = (char *)GET(RUN_PREV(run));
+    if (prev == NULL)
+        PUT(slab_runs(cls), next);
+    else
+        PUT(RUN_NEXT(prev), next);
+    if (next != NULL)
+        PUT(RUN_PREV(next), prev);
 }
 
 /*
- * To malloc, place the payload of size size into the block bp we just found
+ * Start a run of slab class cls, from a spare run or from unused address
+ * space, NULL if all of it is used
  */
-static void * place(void * bp, size_t size)
+static char * run_create(int cls)
 {
-    size_t total_size = GET_SIZE(HDRP(bp));
-    size_t rem_size = total_size - size;
-    pop_free(bp);
-
-    // case 1: remaining space is less than the minimal size (4 words)
-    if (rem_size < 4 * WSIZE) {
-        PUT(HDRP(bp), PACK(total_size, 1));
-        PUT(FTRP(bp), PACK(total_size, 1));
-    }
+    char * run;
+    if ((run = slab_spare) != NULL)
+        slab_spare = (char *)GET(run);
+    else if (slab_top < slab_base + SLAB_SPAN)
+        slab_top = (run = slab_top) + PAGESIZE;
+    if (run == NULL)
+        return NULL;
 
-    // for case 2 and 3, we essentially want to decide whether to allocate the
-    // first portion of the free block for the payload or the latter portion
-    // the threshold is based on the experiments
-    // case 2: remaining space sufficient, and the remaining size relatively big
-    else if (rem_size >= THRESHOLD * size) {
-        place_fb(bp, size, rem_size, 1);
-        add_free(NEXT_BLKP(bp), rem_size); // add remaining free block to free list
+    unsigned long count = RUN_COUNT(cls);
+    PUT(RUN_CLASS(run), cls);
+    PUT(RUN_FREE(run), count);
+    for (unsigned long i = 0; i < RUN_MAPS; ++i, count -= MIN(count, 8*WSIZE)) {
+        PUT(RUN_MAP(run, i), count >= 8*WSIZE ? ~0UL : (1UL << count) - 1);
     }
+    run_link(cls, run);
+    return run;
+}
 
-    // case 3: remaining space sufficient, and the remaining size relatively small
-    else {
-        place_fb(bp, rem_size, size, 0);
-        add_free(bp, rem_size);
-        return NEXT_BLKP(bp);
-    }
+/*
+ * Allocate a slot of at least size bytes, the heap must be locked
+ */
+static void * slab_alloc(size_t size)
+{
+    int cls = (size - 1) / ALIGNMENT;
+    char * run = (char *)GET(slab_runs(cls));
+    if (run == NULL && (run = run_create(cls)) == NULL)
+        return NULL;
 
-    return bp;
+    // a run in the list has a free slot, the first one is taken
+    int i = 0;
+    while (GET(RUN_MAP(run, i)) == 0)
+        ++i;
+    unsigned long map = GET(RUN_MAP(run, i));
+    unsigned long slot = i * 8*WSIZE + __builtin_ctzl(map);
+    PUT(RUN_MAP(run, i), map & (map - 1));
+    PUT(RUN_FREE(run), GET(RUN_FREE(run)) - 1);
+    if (GET(RUN_FREE(run)) == 0)
+        run_unlink(cls, run);
+    return RUN_SLOTS(run) + slot * SLOT_SIZE(cls);
 }
 
-
-// helper function: given a size, return an index in the free list
-// the i-th free list stores blocks of up to 4*WSIZE ^ (i+1) bytes
-// the index returned is such that the index-th free list can store
-// a block of size bytes
-static int index_of(size_t size)
+/*
+ * Free a slot, the heap must be locked
+ * A run that was full goes back into the list of its class, and a run that is
+ * empty now is given up, unless it is the only one of its class with free
+ * slots, so that a slot allocated and freed over and over does not take and
+ * give up a run every time
+ */
+static void slab_free(void * bp)
 {
-    int index = 0;
-    for (int curr_size = 4*WSIZE; curr_size < ((4*WSIZE)<<(LISTSIZE-1)); curr_size*=2)
-    {
-        if (curr_size >= size)
-            break;
-        ++index;
+    char * run = RUN_OF(bp);
+    int cls = GET(RUN_CLASS(run));
+    unsigned long slot = ((char *)bp - RUN_SLOTS(run)) / SLOT_SIZE(cls);
+    unsigned long nfree = GET(RUN_FREE(run)) + 1;
+
+    PUT(RUN_MAP(run, slot / (8*WSIZE)),
+        GET(RUN_MAP(run, slot / (8*WSIZE))) | (1UL << (slot % (8*WSIZE))));
+    PUT(RUN_FREE(run), nfree);
+    if (nfree == 1) {
+        run_link(cls, run);
+    } else if (nfree == RUN_COUNT(cls) &&
+               (GET(RUN_NEXT(run)) != 0 || GET(RUN_PREV(run)) != 0)) {
+        run_unlink(cls, run);
+#ifdef PURGE
+        madvise(run, PAGESIZE, MADV_DONTNEED);
+#endif
+        PUT(run, slab_spare);
+        slab_spare = run;
     }
-    return index;
 }
+#endif
 
 
-/*
- * Add a free block of size size to one of the free lists
- */
-static void add_free(void * bp, size_t size)
-{
-    // find the corresponding free list for the size
-    int index = index_of(size);
 
-    // in the free list, find the corresponding block (first fit)
-    //    case 1: free list is empty
-    char * curr_ptr = !GET(freelists(index))? NULL : *(char **)freelists(index);
-    char * pred_ptr = curr_ptr;
-    //    case 2: free list is not empty
-    while ((curr_ptr != NULL) && size > GET_SIZE(HDRP(curr_ptr))) {
-        pred_ptr = curr_ptr;
-        curr_ptr = SUCC_BLKP(curr_ptr);
-    }
+#ifdef THREADS
+/**********************************
+ * Thread caches
+ **********************************/
 
-    // by the info we got so far, we know where to place the new free block
-    //  possibility 1: free list is empty
-    if (GET(freelists(index)) == 0) {
-        PUT(bp, NULL);
-        PUT((char *)bp + WSIZE, NULL);
-        PUT(freelists(index), bp);
-    }
+// helper function: given an aligned size, return the bin of the thread cache
+// holding blocks of exactly that size, or -1 if it is too big to be cached
+static inline int tcache_index(size_t size)
+{
+    if (size >= 4*WSIZE + TCACHE_BINS*ALIGNMENT)
+        return -1;
+    return (size - 4*WSIZE) / ALIGNMENT;
+}
 
-    //  possibility 2: free list is not empty, but ptr is NULL, meaning --
-    //                 we are adding the free block at the end of the free list
-    else if (curr_ptr == NULL) {
-        PUT(bp, pred_ptr);
-        PUT((char *)bp + WSIZE, NULL);
-        PUT((char *)pred_ptr + WSIZE, bp);
+// pop a block from a bin of the thread cache, NULL if the bin is empty
+static inline void * tcache_get(int index)
+{
+    char * bp = *(char **)tcache_bin(index);
+    if (bp != NULL) {
+        PUT(tcache_bin(index), *(char **)bp);
+        PUT(tcache_len(index), GET(tcache_len(index)) - 1);
     }
+    return bp;
+}
 
-    //  possibility 3: free list is not empty, ptr is the first block in free list
-    else if (curr_ptr == *(char **)freelists(index)) {
-        PUT(bp, NULL);
-        PUT((char *)bp + WSIZE, curr_ptr);
-        PUT(curr_ptr, bp);
-        PUT(freelists(index), bp);
-    }
+// push a block to a bin of the thread cache
+static inline void tcache_put(int index, void * bp)
+{
+    PUT(bp, *(char **)tcache_bin(index));
+    PUT(tcache_bin(index), bp);
+    PUT(tcache_len(index), GET(tcache_len(index)) + 1);
+}
 
-    //  possibility 4: free list is not empty, ptr is in the middle of free list
-    else {
-        PUT(bp, pred_ptr);
-        PUT((char *)bp + WSIZE, curr_ptr);
-        PUT(curr_ptr, bp);
-        PUT((char *)pred_ptr + WSIZE, bp);
-    }
+// thread exit: give every cached block and the cache itself back to the heap
+static void tcache_destroy(void * cache)
+{
+    if (tcache_epoch != heap_epoch)
+        return;
+    tcache = cache;
+    for (int i = 0; i < TCACHE_BINS; ++i)
+        tcache_flush(i, GET(tcache_len(i)));
+    LOCK_OWNER(tcache);
+    free_block(tcache);
+    UNLOCK_HEAP();
+    tcache = NULL;
+    tcache_epoch = 0;
 }
 
+static void tcache_key_create(void)
+{
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
 
 /*
- * Delete a block from a free list because it has just been allocated
+ * Allocate an empty cache for this thread, the heap must be locked
+ * Return 0 if the heap could not provide one
  */
-static void pop_free(void * bp)
+static int tcache_create(void)
 {
-    size_t size = GET_SIZE(HDRP(bp));
-    int index = index_of(size);
+    pthread_once(&tcache_once, tcache_key_create);
+    if ((tcache = alloc_block(align_size(2 * TCACHE_BINS * WSIZE))) == NULL)
+        return 0;
+    memset(tcache, 0, 2 * TCACHE_BINS * WSIZE);
+    tcache_epoch = heap_epoch;
+    pthread_setspecific(tcache_key, tcache);
+    return 1;
+}
 
-    if (PRED_BLKP(bp) == NULL) {
+/*
+ * Move TCACHE_FILL blocks of size bytes from the heap to an empty bin,
+ * the heap must be locked
+ */
+static void tcache_fill(int index, size_t size)
+{
+    void * bp;
+    for (int i = 0; i < TCACHE_FILL; ++i) {
+        if ((bp = alloc_block(size)) == NULL)
+            return;
+        tcache_put(index, bp);
+    }
+}
 
-        //  possibility 1: predecessor is null, successor is null
-        if (SUCC_BLKP(bp) == NULL) {
-            PUT(freelists(index), 0);
+/*
+ * Give up to count blocks of a bin back to the arenas they came from, taking
+ * the lock of this thread's arena at most once and queueing the blocks of
+ * other arenas as remote frees; no arena may be locked
+ */
+static void tcache_flush(int index, int count)
+{
+    char * bp;
+    int locked = 0;
+    while (count-- > 0 && (bp = tcache_get(index)) != NULL) {
+        if (GET_ARENA(HDRP(bp)) != my_arena) {
+            remote_free(bp);
+            continue;
         }
-        //  possibility 2: predecessor is null, successor is not null
-        else {
-            PUT(freelists(index), SUCC_BLKP(bp));
-            PUT(SUCC_BLKP(bp), NULL);
+        if (!locked) {
+            LOCK_OWNER(bp);
+            locked = 1;
         }
+        free_block(bp);
     }
+    if (locked)
+        UNLOCK_HEAP();
+}
 
-    else {
 
-        //  possibility 3: predecessor is not null, successor is null
-        if (SUCC_BLKP(bp) == NULL) {
-            PUT((char *)PRED_BLKP(bp) + WSIZE, NULL);
-        }
-        //  possibility 4: predecessor is not null, successor is not null
-        else {
-            PUT((char *)PRED_BLKP(bp) + WSIZE, SUCC_BLKP(bp));
-            PUT((char *)SUCC_BLKP(bp), PRED_BLKP(bp));
-        }
+/**********************************
+ * Remote frees
+ **********************************/
+
+// a remote free queue is a lock-free stack of blocks linked through the first
+// word of their payload, pushed by any thread and emptied at once by the one
+// holding the arena lock, so no block can be popped while another is pushed;
+// the length of the queue is kept apart in its arena, as a queued block may be
+// drained and reused by then, and is only a hint of when to drain it
+
+/*
+ * Queue a block for the arena it belongs to without taking its lock
+ * If the queue gets long, the owner is not coming by, so drain it here;
+ * the arena this thread may hold stays the current one
+ */
+static void remote_free(void * bp)
+{
+    unsigned long index = GET_ARENA(HDRP(bp));
+    char * arena = arenas[index];
+    char * head = __atomic_load_n(arena_remote(arena), __ATOMIC_ACQUIRE);
+    do {
+        PUT(bp, head);
+    } while (!__atomic_compare_exchange_n(arena_remote(arena), &head, bp, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+    // once pushed the block may already be drained and reused, don't touch it
+    // (a drain may also come before the count, which then dips below zero)
+    long count = __atomic_add_fetch(arena_queued(arena), 1, __ATOMIC_RELAXED);
+    if (count >= REMOTE_MAX &&
+        pthread_mutex_trylock(arena_lock(arena)) == 0) {
+        char * held = heap_ptr;
+        unsigned long held_tag = arena_tag;
+        heap_ptr  = arena;
+        arena_tag = index << ARENA_SHIFT;
+        drain_remote();
+        UNLOCK_HEAP();
+        heap_ptr  = held;
+        arena_tag = held_tag;
     }
 }
 
+/*
+ * Free every block queued for the current arena, the arena must be locked
+ */
+static void drain_remote(void)
+{
+    char * bp = __atomic_exchange_n(arena_remote(heap_ptr), NULL, __ATOMIC_ACQUIRE);
+    char * next;
+    long count = 0;
+    for (; bp != NULL; bp = next, ++count) {
+        next = *(char **)bp;
+        free_block(bp);
+    }
+    __atomic_sub_fetch(arena_queued(heap_ptr), count, __ATOMIC_RELAXED);
+}
+#endif
 
 
 #ifdef DEBUG
@@ -500,6 +2580,7 @@ static void pop_free(void * bp)
  **********************************/
 
 // prints contents of block: "addr: header: size,alloc || footer: size,alloc"
+// allocated blocks have no footer, so only their header is printed
 static void printblock(void *bp)
 {
 #ifdef VERBOSE
@@ -507,19 +2588,37 @@ static void printblock(void *bp)
 
     hdr_size  = GET_SIZE(HDRP(bp));
     hdr_alloc = GET_ALLOC(HDRP(bp));
-    ftr_size  = GET_SIZE(FTRP(bp));
-    ftr_alloc = GET_ALLOC(FTRP(bp));
 
     if (hdr_size == 0) {
         printf("%p: epilogue\n", bp);
         return;
     }
+    if (hdr_alloc) {
+        printf("%p: header: %lu,%lu\n", bp, hdr_size, hdr_alloc);
+        return;
+    }
 
+    ftr_size  = GET_SIZE(FTRP(bp));
+    ftr_alloc = GET_ALLOC(FTRP(bp));
     printf("%p: header: %lu,%lu || footer: %lu,%lu\n",
             bp, hdr_size, hdr_alloc, ftr_size, ftr_alloc);
 #endif
 }
 
+#ifndef TLSF
+// helper function: check the treap under t, whose blocks come in the list
+// from *next on, and advance *next past them; 0 if the two differ
+static int check_tree(char * t, char ** next)
+{
+    if (t == NULL)
+        return 1;
+    if (!check_tree(TREE_LEFT(t), next) || *next != t)
+        return 0;
+    *next = SUCC_BLKP(t);
+    return check_tree(TREE_RIGHT(t), next);
+}
+#endif
+
 /*
  * checks 1. prologue and epilogue are good
  *        2. every block in free list marked as free
@@ -527,6 +2626,12 @@ static void printblock(void *bp)
  *        4. no contiguous free blocks
  *        5. payloads do not overlap
  *        6. heapsize = free block size + alloc block size + auxiliary data
+ *        7. bitmaps of non-empty free lists match the free lists
+ *        8. prev-allocated bits match the blocks before them
+ *        9. treaps hold the blocks of their lists, in the same order
+ *       10. blocks are marked as in the unsorted bin iff they are
+ *       11. fast bins hold allocated blocks of their size, and match the bitmap
+ *       12. runs of slabs in the lists have free slots, as many as they count
  */
 static int mm_check()
 {
@@ -550,11 +2655,6 @@ static int mm_check()
         printf("%lu\n", GET_SIZE(HDRP(heap_ptr)));
         return 0;
     }
-    if ((GET_SIZE(mem_heap_hi() - WSIZE + 1) != 0) ||
-                    !GET_ALLOC(mem_heap_hi() - WSIZE + 1)) {
-        printf("Bad epilogue header\n");
-        return 0;
-    }
 
     // check if every block in the free list marked as free, and keep count
     // also keep count of total free block size, version 1
@@ -562,23 +2662,75 @@ static int mm_check()
     int count = 0;
     size_t fre_size_explicit = 0;
     for (int i = 0; i < LISTSIZE; ++i) {
+#ifdef TLSF
+        int marked = (GET(listmap(1 + i / SL_COUNT)) & (1UL << (i % SL_COUNT))) &&
+                     (GET(listmap(0)) & (1UL << (i / SL_COUNT)));
+#else
+        int marked = (GET(listmap(0)) >> i) & 1;
+#endif
+        if (!GET(freelists(i)) != !marked) {
+            printf("Bitmap of free list %i inconsistent\n", i);
+            return 0;
+        }
         if (GET(freelists(i)) != 0) {
             ++count;
             bp = *(char **)freelists(i);
             fre_size_explicit += GET_SIZE(HDRP(bp));
-            if (GET_ALLOC(HDRP(bp)) == 1) {
+            if (GET(HDRP(bp)) & (1 | UNSORTED)) {
                 printf("Block %p in free list not marked as free\n", bp);
                 return 0;
             }
             while ((bp = SUCC_BLKP(bp)) != NULL) {
                 ++count;
                 fre_size_explicit += GET_SIZE(HDRP(bp));
-                if (GET_ALLOC(HDRP(bp)) == 1) {
+                if (GET(HDRP(bp)) & (1 | UNSORTED)) {
                     printf("Block %p in free list not marked as free\n", bp);
                     return 0;
                 }
             }
         }
+#ifndef TLSF
+        char * next = *(char **)freelists(i);
+        if (i >= TREE_LIST &&
+            (!check_tree(*(char **)tree_root(i), &next) || next != NULL)) {
+            printf("Treap of free list %i inconsistent\n", i);
+            return 0;
+        }
+#endif
+    }
+    for (int i = 0; i < FAST_BINS; ++i) {
+        if (!GET(fast_bin(i)) != !(GET(fast_map()) & (1UL << i))) {
+            printf("Bitmap of fast bin %i inconsistent\n", i);
+            return 0;
+        }
+        for (bp = *(char **)fast_bin(i); bp != NULL; bp = *(char **)bp) {
+            if (!GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) != 4*WSIZE + i*ALIGNMENT) {
+                printf("Block %p in fast bin %i not an allocated block of its size\n",
+                       bp, i);
+                return 0;
+            }
+        }
+    }
+#ifdef SLAB
+    for (int i = 0; i < SLAB_CLASSES; ++i) {
+        for (char * run = *(char **)slab_runs(i); run != NULL; run = *(char **)run) {
+            unsigned long nfree = 0;
+            for (int j = 0; j < RUN_MAPS; ++j)
+                nfree += __builtin_popcountl(GET(RUN_MAP(run, j)));
+            if ((int)GET(RUN_CLASS(run)) != i || nfree == 0 || nfree != GET(RUN_FREE(run))) {
+                printf("Run %p of slab class %i inconsistent\n", run, i);
+                return 0;
+            }
+        }
+    }
+#endif
+    for (bp = *(char **)unsorted_bin(); bp != NULL; bp = SUCC_BLKP(bp)) {
+        ++count;
+        fre_size_explicit += GET_SIZE(HDRP(bp));
+        if ((GET(HDRP(bp)) & (1 | UNSORTED)) != UNSORTED) {
+            printf("Block %p in unsorted bin not marked as such\n", bp);
+            return 0;
+        }
     }
 #ifdef VERBOSE
     printf("Free blocks in free lists: %i\n", count);
@@ -586,11 +2738,19 @@ static int mm_check()
     // check if there are contiguous free blocks, and keep count
     // also keep count of the total payload size
     // also keep count of total free block size, version 2
-    bp = heap_ptr;
+    // every segment is walked from its prologue up to its epilogue
     int consec = 0;
     size_t pld_size = 0;
     size_t fre_size_implicit = 0;
-    while ((unsigned long)bp < (unsigned long)mem_heap_hi()) {
+    for (char * seg = last_segment(); seg != NULL; seg = prev_segment(seg)) {
+    bp = seg;
+    int prev_alloc = 1;
+    while (GET_SIZE(HDRP(bp)) != 0) {
+        if (!GET_PREV_ALLOC(HDRP(bp)) != !prev_alloc) {
+            printf("Prev-allocated bit of block %p inconsistent\n", bp);
+            return 0;
+        }
+        prev_alloc = GET_ALLOC(HDRP(bp));
         if (GET_ALLOC(HDRP(bp)) == 0) {
             --count;
             ++consec;
@@ -607,6 +2767,15 @@ static int mm_check()
         printblock(bp); // print contents of each block
         bp = NEXT_BLKP(bp);
     }
+    if (!GET_ALLOC(HDRP(bp))) {
+        printf("Bad epilogue header\n");
+        return 0;
+    }
+    if (!GET_PREV_ALLOC(HDRP(bp)) != !prev_alloc) {
+        printf("Bad epilogue prev-allocated bit\n");
+        return 0;
+    }
+    }
 
     // check if all free blocks are in free list and vice versa
     if (count < 0) {
@@ -624,13 +2793,17 @@ static int mm_check()
         return 0;
     }
 
+#if !defined(THREADS) && !defined(MMAP)
     // check if there is potential payload overlap
-    // freeblk size + payld size + (freelist ptrs + epilog hdr + heap initial padding)
+    // freeblk size + payld size + (freelist ptrs + epilog hdr + bitmaps)
     // should be equal to total heapsize
-    if (fre_size_explicit + pld_size + ((LISTSIZE+2) * WSIZE)> mem_heapsize()) {
+    // (arenas share the heap, and segments are mapped outside of it, so this
+    // only holds for a single heap from mem_sbrk)
+    if (fre_size_explicit + pld_size + ((MAPSIZE+LISTSIZE+1) * WSIZE)> mem_heapsize()) {
         printf("Potential payload overlap\n");
         return 0;
     }
+#endif
     return 1;
 }
 #endif